@@ -34,7 +34,7 @@ int kvm_async_invocation(VRT_CTX, const struct kvm_chain_item *invoc)
 
 		// Reserve a machine through blocking queue.
 		// May throw if dequeue from the queue times out.
-		auto resv = prog->reserve_vm(ctx, tenant, std::move(prog));
+		auto resv = prog->reserve_vm(ctx, tenant, std::move(prog), false, invoc->priority);
 		// prog is nullptr after this ^
 
 		/* During startup the task_future is used to wait for initialization.
@@ -42,6 +42,9 @@ int kvm_async_invocation(VRT_CTX, const struct kvm_chain_item *invoc)
 
 		   We can safely pass invoc because it is workspace-allocated. */
 		auto* slot = resv.slot;
+		/* The thread leaves the handoff loop to run the call as a
+		   thread task, and parks in it again before the VM is freed. */
+		slot->stop_handoff();
 		slot->task_future = slot->tp.enqueue(
 		[slot, invoc] () -> long {
 
@@ -71,6 +74,7 @@ int kvm_async_invocation(VRT_CTX, const struct kvm_chain_item *invoc)
 				(void)e;
 			}
 
+			slot->start_handoff();
 			machine.program().vm_free_function(slot);
 			return 0L;
 		});
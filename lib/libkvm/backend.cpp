@@ -37,6 +37,7 @@
 **/
 #include "tenant_instance.hpp"
 #include "program_instance.hpp"
+#include "scoped_allocations.hpp"
 #include "scoped_duration.hpp"
 #include "settings.hpp"
 #include "varnish.hpp"
@@ -283,17 +284,16 @@ static void error_handling(kvm::VMPoolItem* slot,
 	try {
 		/* Check if the program is configured to open a remote GDB session on exception. */
 		if (machine.tenant().config.group.remote_debug_on_exception) {
-			auto fut = slot->tp.enqueue(
+			slot->call(
 			[&] () -> long {
 				/* Open a remote GDB session on the VM. */
 				machine.open_debugger(2159, 5 * 60.0f);
 				return 0L;
 			});
-			fut.get();
 		}
 		/* Check if the program has a backend_error callback. */
 		if (prog.entry_at(ProgramEntryIndex::BACKEND_ERROR) != 0x0) {
-		auto fut = slot->tp.enqueue(
+		slot->call(
 		[&] () -> long {
 			auto& machine = *slot->mi;
 			auto* ctx = machine.ctx();
@@ -322,7 +322,6 @@ static void error_handling(kvm::VMPoolItem* slot,
 			fetch_result(slot, machine, result);
 			return 0L;
 		});
-		fut.get();
 		return;
 		} // error callback
 	} catch (const tinykvm::MachineTimeoutException& mte) {
@@ -437,13 +436,17 @@ void kvm_backend_call(VRT_CTX, kvm::VMPoolItem* slot,
 	MachineInstance& machine = *slot->mi;
 	/* Setting the VRT_CTX allows access to HTTP and VSL, etc. */
 	machine.set_ctx(ctx);
+	/* Heap allocations on this side of the call. */
+	ScopedAllocations allocs(machine.request_allocations());
+	/* Wall-time of the call, including error handling. */
+	ScopedLatency call_latency(machine.program().latency.vm_call);
 
 	if constexpr (VERBOSE_BACKEND) {
 		VSLb(ctx->vsl, SLT_VCL_Log, "Tenant: %s", machine.name().c_str());
 	}
 
 	try {
-		auto fut = slot->tp.enqueue(
+		slot->call(
 		[slot, invoc, post, result] () -> long {
 			if constexpr (VERBOSE_BACKEND) {
 				printf("Begin backend %s %s (arg=%s)\n", invoc->inputs.method,
@@ -453,6 +456,8 @@ void kvm_backend_call(VRT_CTX, kvm::VMPoolItem* slot,
 
 			/* Regular CPU-time. */
 			ScopedDuration cputime(machine.stats().request_cpu_time);
+			/* Heap allocations inside the VM thread. */
+			ScopedAllocations allocs(machine.request_allocations());
 
 			/* Enforce that guest program calls the backend_response system call. */
 			machine.begin_call();
@@ -564,7 +569,6 @@ void kvm_backend_call(VRT_CTX, kvm::VMPoolItem* slot,
 			fetch_result(slot, machine, result);
 			return 0L;
 		});
-		fut.get();
 		return;
 
 	} catch (const tinykvm::MachineTimeoutException& mte) {
@@ -618,7 +622,7 @@ int kvm_backend_streaming_post(struct backend_post *post,
 		const auto call_addr =
 			mi.program().entry_at(ProgramEntryIndex::BACKEND_STREAM);
 		if (call_addr != 0x0) {
-			auto fut = slot.tp.enqueue(
+			slot.call(
 			[&] () -> long {
 				/* Regular CPU-time. */
 				ScopedDuration cputime(mi.stats().request_cpu_time);
@@ -634,7 +638,6 @@ int kvm_backend_streaming_post(struct backend_post *post,
 					(uint64_t)post->length);
 				return 0L;
 			});
-			fut.get();
 
 			/* Increment POST length *after* VM call. */
 			post->length += data_len;
@@ -701,7 +704,7 @@ ssize_t kvm_backend_streaming_delivery(
 		auto& vm = mi.machine();
 
 		/* Call the backend streaming function, if set. */
-		auto fut = slot.tp.enqueue(
+		slot.call(
 		[&] () -> long {
 			/* Regular CPU-time. */
 			ScopedDuration cputime(mi.stats().request_cpu_time);
@@ -713,7 +716,6 @@ ssize_t kvm_backend_streaming_delivery(
 				(uint64_t)result->content_length);
 			return 0L;
 		});
-		fut.get();
 
 		const auto& regs = vm.registers();
 		/* NOTE: RAX gets moved to RDI. RDX is length.
@@ -755,8 +757,7 @@ namespace kvm {
 
 static bool perform_warmup_request(
 	MachineInstance& machine,
-	const struct kvm_chain_item *invoc,
-	const std::unordered_set<std::string>& headers)
+	const TenantGroup::Warmup::Request& request)
 {
 	try {
 		auto& vm = machine.machine();
@@ -764,18 +765,34 @@ static bool perform_warmup_request(
 		/* Enforce that guest program calls the backend_response system call. */
 		machine.begin_call();
 
+		kvm_chain_item invoc {};
+		invoc.tenant = (struct vmod_kvm_tenant *)&machine.tenant();
+		invoc.inputs.method = request.method.c_str();
+		invoc.inputs.url = request.url.c_str();
+		invoc.inputs.argument = "";
+		invoc.inputs.content_type = request.content_type.c_str();
+
 		/* Allocate 16KB space for struct backend_inputs */
 		struct backend_inputs inputs {};
 		if (machine.get_inputs_allocation() == 0) {
 			machine.get_inputs_allocation() = vm.mmap_allocate(BACKEND_INPUTS_SIZE) + BACKEND_INPUTS_SIZE;
 		}
 		__u64 stack = machine.get_inputs_allocation();
+		/* POST data is copied into the same area as real POST data */
+		struct backend_post post_data {};
 		struct backend_post *post = nullptr;
-		fill_backend_inputs(machine, stack, invoc, post, inputs);
+		if (!request.body.empty()) {
+			post_data.address = machine.allocate_post_data(request.body.size());
+			post_data.capacity = request.body.size();
+			post_data.length = request.body.size();
+			vm.copy_to_guest(post_data.address, request.body.data(), request.body.size());
+			post = &post_data;
+		}
+		fill_backend_inputs(machine, stack, &invoc, post, inputs);
 		/* We are not using a VRT_CTX here, so we will manually fill headers */
 		std::vector<backend_header> header_array;
 		/* Push each header field to the stack */
-		for (const auto& header : headers) {
+		for (const auto& header : request.headers) {
 			if (header.find(':') == std::string::npos) {
 				throw std::runtime_error("Invalid header in warmup: " + header);
 			}
@@ -787,7 +804,7 @@ static bool perform_warmup_request(
 		/* Push the header array to the stack using stack_push_std_array */
 		const auto header_array_addr = vm.stack_push_std_array(stack, header_array, header_array.size());
 		inputs.g_headers = header_array_addr;
-		inputs.num_headers = headers.size();
+		inputs.num_headers = request.headers.size();
 		inputs.info_flags = 0x1; // Warmup request
 
 		auto& regs = vm.registers();
@@ -822,18 +839,16 @@ static bool perform_warmup_request(
 	}
 }
 
-void backend_warmup_pause_resume(MachineInstance& machine,
-	const struct kvm_chain_item *invoc,
-	const TenantGroup::Warmup& warmup)
+ProgramInstance::Warmup backend_warmup_pause_resume(MachineInstance& machine,
+	const TenantGroup::Warmup& warmup, bool single_pass)
 {
 	/* This is a mock call to the backend. It makes a call to the
 	   backend to warm up the VM, but does not actually fetch the
 	   result. This is used to eg. warm up JIT caches, or to
 	   pre-allocate buffers. */
-	if constexpr (VERBOSE_BACKEND) {
-		printf("Begin backend %s %s (arg=%s)\n", invoc->inputs.method,
-			invoc->inputs.url, invoc->inputs.argument);
-	}
+	const auto& requests = warmup.requests;
+	if (requests.empty())
+		throw std::runtime_error("Warmup has no requests");
 	auto& vm = machine.machine();
 	const struct vrt_ctx* previous_ctx = machine.ctx();
 	const bool had_profiling = vm.is_profiling();
@@ -861,45 +876,69 @@ void backend_warmup_pause_resume(MachineInstance& machine,
 	http_req.field_flags = (unsigned char*)WS_Alloc(ws, sizeof(unsigned char) * HTTP_FIELDS);
 	std::memset(http_req.field_array, 0, sizeof(struct easy_txt) * HTTP_FIELDS);
 
+	/* The requests of a corpus differ in cost, so the heuristic compares
+	   the time of whole passes over the requests, and exact warmup
+	   counts requests. A single pass is one request per corpus entry. */
+	ProgramInstance::Warmup result;
+	const uint64_t t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	const size_t total_requests = single_pass ? requests.size() : warmup.num_requests;
 	const int MAX_BAILOUT = warmup.num_requests;
 	int improvement_bailout = MAX_BAILOUT; // Stop if no improvement after N tries
-	uint64_t best_time = UINT64_MAX;
-	for (int i = 0;; i++) {
+	uint64_t pass_time = 0;
+	for (size_t i = 0;; i++) {
+		const auto& request = requests[i % requests.size()];
+		if constexpr (VERBOSE_BACKEND) {
+			printf("Begin backend %s %s\n", request.method.c_str(), request.url.c_str());
+		}
 		{
 			tinykvm::ScopedProfiler<tinykvm::MachineProfiling::UserDefined> prof(vm.profiling());
-			if (!perform_warmup_request(machine, invoc, warmup.headers))
+			if (!perform_warmup_request(machine, request))
 				break;
 		}
-		if (warmup.exact) {
+		result.requests++;
+		if (const auto* profiler = vm.profiling(); profiler != nullptr) {
+			pass_time += profiler->times[tinykvm::MachineProfiling::UserDefined].back();
+		}
+		const bool end_of_pass = (i + 1) % requests.size() == 0;
+		if (end_of_pass) {
+			result.passes++;
+			if (result.passes == 1)
+				result.first_pass = pass_time;
+		}
+		if (warmup.exact || single_pass) {
 			// Exact number of warmup requests, so just do that many
-			if (i+1 >= warmup.num_requests) {
+			if (end_of_pass && (result.best_pass == 0 || pass_time < result.best_pass))
+				result.best_pass = pass_time;
+			if (i+1 >= total_requests) {
 				if (machine.tenant().config.group.verbose) {
-					printf("Warmup: Completed %d exact warmup requests\n", warmup.num_requests);
+					printf("Warmup: Completed %zu exact warmup requests\n", total_requests);
 				}
 				break;
 			}
 		}
-		else if (const auto* profiler = vm.profiling(); profiler != nullptr) {
+		else if (end_of_pass) {
 			/* Heuristic: Check if this was an improvement */
-			const auto& samples = profiler->times[tinykvm::MachineProfiling::UserDefined];
-			const bool is_improvement = (samples.back() < best_time);
+			const bool is_improvement = (result.best_pass == 0 || pass_time < result.best_pass);
 			if (is_improvement) {
-				best_time = samples.back();
+				result.best_pass = pass_time;
 				improvement_bailout = MAX_BAILOUT; // Reset bailout counter
 				if (machine.tenant().config.group.verbose) {
-					printf("Warmup: New best time: %lu ns (iteration %d)\n", best_time, i);
+					printf("Warmup: New best time: %lu ns (pass %u)\n", pass_time, result.passes);
 				}
 			} else {
 				// Not an improvement, so we can stop here
 				if (--improvement_bailout == 0) {
 					if (machine.tenant().config.group.verbose) {
-						printf("Warmup: No improvement after %d tries, stopping warmup. Iterations: %d\n", MAX_BAILOUT, i);
+						printf("Warmup: No improvement after %d tries, stopping warmup. Passes: %u\n", MAX_BAILOUT, result.passes);
 					}
 					break;
 				}
 			}
 		}
+		if (end_of_pass)
+			pass_time = 0;
 	}
+	result.duration = ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0;
 
 	machine.set_ctx(previous_ctx);
 	kvm_FreeWorkspace(ws);
@@ -907,9 +946,7 @@ void backend_warmup_pause_resume(MachineInstance& machine,
 	if (!had_profiling) {
 		vm.set_profiling(false);
 	}
-	if constexpr (VERBOSE_BACKEND) {
-		printf("Finish backend %s %s\n", invoc->inputs.method, invoc->inputs.url);
-	}
+	return result;
 }
 
 } // namespace kvm
@@ -0,0 +1,70 @@
+#include "binary_cache.hpp"
+
+#include "utils/crc32.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace kvm
+{
+	BinaryCache& BinaryCache::get()
+	{
+		static BinaryCache cache;
+		return cache;
+	}
+
+	BinaryStorage BinaryCache::deduplicate(BinaryStorage binary, const void* owner)
+	{
+		if (binary.empty())
+			return binary;
+		const uint32_t crc = crc32c_hw((const char *)binary.data(), binary.size());
+
+		std::scoped_lock lock(m_mtx);
+		this->prune_unused();
+		for (auto& entry : m_entries) {
+			// The checksum only narrows it down, the contents decide
+			if (entry.crc == crc && entry.binary.size() == binary.size()
+				&& std::memcmp(entry.binary.data(), binary.data(), binary.size()) == 0)
+			{
+				if (std::find(entry.owners.begin(), entry.owners.end(), owner) == entry.owners.end())
+					entry.owners.push_back(owner);
+				return entry.binary;
+			}
+		}
+		m_entries.push_back({crc, binary, {owner}});
+		return binary;
+	}
+
+	void BinaryCache::release(const void* owner)
+	{
+		std::scoped_lock lock(m_mtx);
+		for (auto& entry : m_entries) {
+			entry.owners.erase(std::remove(entry.owners.begin(), entry.owners.end(), owner),
+				entry.owners.end());
+		}
+	}
+
+	long BinaryCache::sharers(const BinaryStorage& binary) const
+	{
+		std::scoped_lock lock(m_mtx);
+		for (const auto& entry : m_entries) {
+			if (entry.binary.data() == binary.data())
+				return std::max(long(entry.owners.size()), 1L);
+		}
+		return 1;
+	}
+
+	size_t BinaryCache::entries() const
+	{
+		std::scoped_lock lock(m_mtx);
+		return m_entries.size();
+	}
+
+	void BinaryCache::prune_unused()
+	{
+		// Entries only referenced by the store itself are unused
+		m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(),
+			[] (const Entry& entry) {
+				return entry.binary.use_count() <= 1;
+			}), m_entries.end());
+	}
+}
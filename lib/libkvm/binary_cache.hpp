@@ -0,0 +1,41 @@
+#pragma once
+#include "binary_storage.hpp"
+#include <mutex>
+#include <vector>
+
+namespace kvm
+{
+	/* Content-addressed store of program binaries. Programs that load
+	   identical binaries, eg. many tenants running the same program
+	   with different arguments, end up sharing one copy. A binary is
+	   dropped from the store once no program is using it. */
+	struct BinaryCache {
+		static BinaryCache& get();
+
+		/* Returns a copy of an identical, already loaded binary when
+		   there is one, and otherwise adds this binary to the store.
+		   The owner (a program) is counted once per binary, even when
+		   it uses the binary for both its request and storage VMs. */
+		BinaryStorage deduplicate(BinaryStorage binary, const void* owner);
+		/* The owner no longer uses any of its binaries. */
+		void release(const void* owner);
+
+		/* Number of programs sharing the given binary, or 1 when it
+		   is not in the store. */
+		long sharers(const BinaryStorage&) const;
+
+		size_t entries() const;
+
+	private:
+		BinaryCache() = default;
+		void prune_unused(); /* Requires m_mtx */
+
+		struct Entry {
+			uint32_t crc;
+			BinaryStorage binary;
+			std::vector<const void*> owners;
+		};
+		mutable std::mutex m_mtx;
+		std::vector<Entry> m_entries;
+	};
+}
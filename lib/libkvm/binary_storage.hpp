@@ -1,6 +1,7 @@
 #pragma once
 #include "mmap_file.hpp"
 #include <cstdint>
+#include <memory>
 #include <span>
 #include <variant>
 #include <vector>
@@ -21,24 +22,27 @@ struct BinaryStorage
 		return std::holds_alternative<MmapFile>(m_binary);
 	}
 	bool is_vector() const noexcept {
-		return std::holds_alternative<std::vector<uint8_t>>(m_binary);
+		return std::holds_alternative<SharedVector>(m_binary);
 	}
+	/* Copies share the binary, and this is how many there are. */
+	long use_count() const noexcept;
 
 	BinaryStorage();
 	BinaryStorage(std::vector<uint8_t> binary)
-		: m_binary(std::move(binary)) {}
+		: m_binary(std::make_shared<const std::vector<uint8_t>>(std::move(binary))) {}
 	BinaryStorage(const std::string& filepath)
 		: m_binary(MmapFile(filepath)) {}
 	BinaryStorage(const BinaryStorage& other);
 	~BinaryStorage() = default;
 
 private:
-	std::variant<std::vector<uint8_t>, MmapFile> m_binary;
+	using SharedVector = std::shared_ptr<const std::vector<uint8_t>>;
+	std::variant<SharedVector, MmapFile> m_binary;
 };
 
 inline void BinaryStorage::set_binary(std::vector<uint8_t> binary)
 {
-	m_binary = std::move(binary);
+	m_binary = std::make_shared<const std::vector<uint8_t>>(std::move(binary));
 }
 inline void BinaryStorage::set_binary(const std::string& filepath)
 {
@@ -47,7 +51,7 @@ inline void BinaryStorage::set_binary(const std::string& filepath)
 inline bool BinaryStorage::empty() const noexcept
 {
 	switch (m_binary.index()) {
-	case 0: return std::get<std::vector<uint8_t>>(m_binary).empty();
+	case 0: return std::get<SharedVector>(m_binary)->empty();
 	case 1: return std::get<MmapFile>(m_binary).empty();
 	default: return true;
 	}
@@ -55,7 +59,7 @@ inline bool BinaryStorage::empty() const noexcept
 inline const uint8_t* BinaryStorage::data() const
 {
 	switch (m_binary.index()) {
-	case 0: return std::get<std::vector<uint8_t>>(m_binary).data();
+	case 0: return std::get<SharedVector>(m_binary)->data();
 	case 1: return std::get<MmapFile>(m_binary).data();
 	default: return nullptr;
 	}
@@ -63,7 +67,7 @@ inline const uint8_t* BinaryStorage::data() const
 inline size_t BinaryStorage::size() const noexcept
 {
 	switch (m_binary.index()) {
-	case 0: return std::get<std::vector<uint8_t>>(m_binary).size();
+	case 0: return std::get<SharedVector>(m_binary)->size();
 	case 1: return std::get<MmapFile>(m_binary).size();
 	default: return 0;
 	}
@@ -71,7 +75,7 @@ inline size_t BinaryStorage::size() const noexcept
 inline std::span<const uint8_t> BinaryStorage::binary() const
 {
 	switch (m_binary.index()) {
-	case 0: return std::span<const uint8_t>(std::get<std::vector<uint8_t>>(m_binary));
+	case 0: return std::span<const uint8_t>(*std::get<SharedVector>(m_binary));
 	case 1: {
 		const MmapFile& mmap = std::get<MmapFile>(m_binary);
 		return std::span<const uint8_t>(mmap.data(), mmap.size());
@@ -82,7 +86,7 @@ inline std::span<const uint8_t> BinaryStorage::binary() const
 inline std::vector<uint8_t> BinaryStorage::to_vector() const
 {
 	switch (m_binary.index()) {
-	case 0: return std::get<std::vector<uint8_t>>(m_binary);
+	case 0: return *std::get<SharedVector>(m_binary);
 	case 1: {
 		const MmapFile& mmap = std::get<MmapFile>(m_binary);
 		return std::vector<uint8_t>(mmap.data(), mmap.data() + mmap.size());
@@ -98,8 +102,17 @@ inline void BinaryStorage::dontneed()
 	}
 }
 
+inline long BinaryStorage::use_count() const noexcept
+{
+	switch (m_binary.index()) {
+	case 0: return std::get<SharedVector>(m_binary).use_count();
+	case 1: return std::get<MmapFile>(m_binary).use_count();
+	default: return 0;
+	}
+}
+
 inline BinaryStorage::BinaryStorage()
-	: m_binary(std::vector<uint8_t>())
+	: m_binary(std::make_shared<const std::vector<uint8_t>>())
 {
 }
 inline BinaryStorage::BinaryStorage(const BinaryStorage& other)
@@ -0,0 +1,101 @@
+#include "budget.hpp"
+
+#include "program_instance.hpp"
+#include <algorithm>
+extern "C" {
+void kvm_varnishstat_budget(uint64_t memory, uint64_t vms);
+void kvm_varnishstat_budget_eviction();
+}
+
+namespace kvm
+{
+	Budget& Budget::get()
+	{
+		static Budget budget;
+		return budget;
+	}
+
+	void Budget::configure(uint64_t max_memory, uint64_t max_vms)
+	{
+		this->m_max_memory = max_memory;
+		this->m_max_vms = max_vms;
+	}
+
+	bool Budget::try_commit(uint64_t memory, uint64_t vms) noexcept
+	{
+		const uint64_t max_memory = m_max_memory.load();
+		const uint64_t max_vms = m_max_vms.load();
+		const uint64_t used_memory = m_used_memory.fetch_add(memory) + memory;
+		const uint64_t used_vms = m_used_vms.fetch_add(vms) + vms;
+		if ((max_memory != 0 && used_memory > max_memory)
+			|| (max_vms != 0 && used_vms > max_vms))
+		{
+			// Concurrent commits may both fail here, and then evict
+			this->release(memory, vms);
+			return false;
+		}
+		this->publish();
+		return true;
+	}
+
+	bool Budget::commit(const ProgramInstance* requester, uint64_t memory, uint64_t vms)
+	{
+		if (try_commit(memory, vms))
+			return true;
+
+		// Evict idle programs, least recently used first. Programs that
+		// are being destroyed can no longer be locked, and are skipped.
+		std::vector<std::shared_ptr<ProgramInstance>> victims;
+		{
+			std::scoped_lock lock(m_programs_mtx);
+			for (auto& entry : m_programs) {
+				if (entry.prog == requester)
+					continue;
+				auto prog = entry.ref.lock();
+				if (prog != nullptr && prog->is_idle())
+					victims.push_back(std::move(prog));
+			}
+		}
+		std::sort(victims.begin(), victims.end(),
+			[] (const auto& a, const auto& b) {
+				return a->last_reserved() < b->last_reserved();
+			});
+		for (auto& prog : victims) {
+			if (prog->pool_evict() > 0) {
+				m_evictions.fetch_add(1);
+				kvm_varnishstat_budget_eviction();
+			}
+			if (try_commit(memory, vms))
+				return true;
+		}
+		// The victims may hold the last references to their programs,
+		// which are then destroyed here, outside of the lock.
+		return false;
+	}
+
+	void Budget::release(uint64_t memory, uint64_t vms) noexcept
+	{
+		m_used_memory.fetch_sub(memory);
+		m_used_vms.fetch_sub(vms);
+		this->publish();
+	}
+
+	void Budget::publish() const noexcept
+	{
+		kvm_varnishstat_budget(m_used_memory.load(), m_used_vms.load());
+	}
+
+	void Budget::add_program(const std::shared_ptr<ProgramInstance>& prog)
+	{
+		std::scoped_lock lock(m_programs_mtx);
+		m_programs.push_back({prog.get(), prog});
+	}
+
+	void Budget::remove_program(const ProgramInstance* prog)
+	{
+		std::scoped_lock lock(m_programs_mtx);
+		m_programs.erase(std::remove_if(m_programs.begin(), m_programs.end(),
+			[prog] (const auto& entry) { return entry.prog == prog; }),
+			m_programs.end());
+	}
+}
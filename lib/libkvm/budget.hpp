@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace kvm
+{
+	class ProgramInstance;
+
+	/* A process-wide budget for memory and request VMs, shared by all
+	   programs. Memory is accounted by what a program is allowed to
+	   commit: main memory and hugepage arenas for the program, and
+	   working memory for each request VM. When a program needs more
+	   than what is left, the request VMs of the least recently used
+	   idle programs are retired until it fits.
+	   A zero limit disables that part of the budget. */
+	struct Budget {
+		static Budget& get();
+
+		void configure(uint64_t max_memory, uint64_t max_vms);
+		bool enabled() const noexcept { return max_memory() != 0 || max_vms() != 0; }
+
+		/* Commit resources on behalf of a program, evicting other
+		   programs when needed. Returns false when they do not fit. */
+		bool commit(const ProgramInstance*, uint64_t memory, uint64_t vms);
+		void release(uint64_t memory, uint64_t vms) noexcept;
+
+		/* Programs are eviction candidates while registered. They are
+		   only referenced weakly, and evictions skip programs that are
+		   being destroyed, so removing a program never waits. */
+		void add_program(const std::shared_ptr<ProgramInstance>&);
+		void remove_program(const ProgramInstance*);
+
+		uint64_t max_memory() const noexcept { return m_max_memory.load(); }
+		uint64_t max_vms() const noexcept { return m_max_vms.load(); }
+		uint64_t used_memory() const noexcept { return m_used_memory.load(); }
+		uint64_t used_vms() const noexcept { return m_used_vms.load(); }
+		uint64_t evictions() const noexcept { return m_evictions.load(); }
+
+	private:
+		Budget() = default;
+		bool try_commit(uint64_t memory, uint64_t vms) noexcept;
+		void publish() const noexcept;
+
+		std::atomic<uint64_t> m_max_memory {0}; /* Bytes */
+		std::atomic<uint64_t> m_max_vms {0};
+		std::atomic<uint64_t> m_used_memory {0};
+		std::atomic<uint64_t> m_used_vms {0};
+		std::atomic<uint64_t> m_evictions {0};
+		/* Programs are evicted without holding the lock, as evicting
+		   may commit to the budget again. */
+		struct Program {
+			const ProgramInstance* prog;
+			std::weak_ptr<ProgramInstance> ref;
+		};
+		std::mutex m_programs_mtx;
+		std::vector<Program> m_programs;
+	};
+}
@@ -0,0 +1,170 @@
+#include "cold_start.hpp"
+
+#include "settings.hpp"
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace kvm
+{
+	struct HotRange {
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	static bool read_hot_set(const std::string& snapshot,
+		const struct stat& snap, std::vector<HotRange>& ranges)
+	{
+		const std::string filename = ColdStart::hot_set_file(snapshot);
+		struct stat st;
+		if (stat(filename.c_str(), &st) != 0 || st.st_size % sizeof(HotRange) != 0)
+			return false;
+		// A hot set recorded for an older snapshot is of no use
+		if (st.st_mtim.tv_sec < snap.st_mtim.tv_sec)
+			return false;
+		FILE* f = fopen(filename.c_str(), "rb");
+		if (f == nullptr)
+			return false;
+		ranges.resize(st.st_size / sizeof(HotRange));
+		const size_t count = fread(ranges.data(), sizeof(HotRange), ranges.size(), f);
+		fclose(f);
+		if (count != ranges.size())
+			return false;
+		for (const auto& range : ranges) {
+			if (range.offset + range.length > uint64_t(snap.st_size))
+				return false;
+		}
+		return true;
+	}
+
+	/* Running programs using each snapshot file, eg. entries of the
+	   snapshot cache, or the same cold_start_file in several groups. */
+	static std::mutex g_users_mtx;
+	static std::unordered_map<std::string, unsigned> g_users;
+
+	bool ColdStart::acquire(const std::string& snapshot)
+	{
+		std::scoped_lock lock(g_users_mtx);
+		this->m_snapshot = snapshot;
+		return ++g_users[snapshot] == 1;
+	}
+
+	ColdStart::~ColdStart()
+	{
+		if (m_snapshot.empty())
+			return;
+		std::scoped_lock lock(g_users_mtx);
+		auto it = g_users.find(m_snapshot);
+		if (it != g_users.end() && --it->second == 0)
+			g_users.erase(it);
+	}
+
+	bool ColdStart::prefetch(const std::string& snapshot)
+	{
+		const bool exclusive = this->acquire(snapshot);
+		const int fd = open(snapshot.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false; /* The snapshot is created by this start */
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return false;
+		}
+
+		bool record = false;
+		switch (this->mode) {
+		case ColdStartRestore::Lazy:
+			break;
+		case ColdStartRestore::HotSet: {
+			std::vector<HotRange> ranges;
+			if (read_hot_set(snapshot, st, ranges)) {
+				// Asynchronous readahead, racing the guest to its pages
+				for (const auto& range : ranges) {
+					posix_fadvise(fd, range.offset, range.length, POSIX_FADV_WILLNEED);
+					this->prefetched += range.length;
+				}
+				this->hot_set = this->prefetched;
+			} else if (exclusive) {
+				// Start out cold, so that only the pages the guest
+				// touches are resident when the hot set is recorded.
+				// Other programs using the file would fault it back in.
+				fsync(fd);
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+				record = true;
+			}
+			} break;
+		case ColdStartRestore::Eager: {
+			// Read the whole file up front, like a restore that copies it
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			std::vector<char> buffer(COLD_START_READ_SIZE);
+			ssize_t len;
+			while ((len = pread(fd, buffer.data(), buffer.size(), this->prefetched)) > 0)
+				this->prefetched += len;
+			} break;
+		}
+		close(fd);
+		return record;
+	}
+
+	void ColdStart::record_hot_set(const std::string& snapshot)
+	{
+		const int fd = open(snapshot.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			close(fd);
+			return;
+		}
+		void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return;
+
+		// Pages of the snapshot in the page cache are the ones that
+		// the restored guest has faulted in (along with readahead).
+		const size_t page_size = sysconf(_SC_PAGESIZE);
+		std::vector<unsigned char> resident((st.st_size + page_size - 1) / page_size);
+		const int res = mincore(map, st.st_size, resident.data());
+		munmap(map, st.st_size);
+		if (res != 0)
+			return;
+
+		std::vector<HotRange> ranges;
+		uint64_t bytes = 0;
+		for (size_t page = 0; page < resident.size(); page++) {
+			if ((resident[page] & 1) == 0)
+				continue;
+			const uint64_t offset = page * page_size;
+			if (!ranges.empty() && ranges.back().offset + ranges.back().length == offset)
+				ranges.back().length += page_size;
+			else
+				ranges.push_back({offset, page_size});
+			bytes += page_size;
+		}
+		if (!ranges.empty() && ranges.back().offset + ranges.back().length > uint64_t(st.st_size))
+			ranges.back().length = st.st_size - ranges.back().offset;
+
+		// Replace the hot set atomically
+		const std::string filename = hot_set_file(snapshot);
+		const std::string tmpname = filename + ".tmp";
+		FILE* f = fopen(tmpname.c_str(), "wb");
+		if (f == nullptr)
+			return;
+		const size_t count = fwrite(ranges.data(), sizeof(HotRange), ranges.size(), f);
+		if (fclose(f) != 0 || count != ranges.size()
+			|| rename(tmpname.c_str(), filename.c_str()) != 0)
+		{
+			unlink(tmpname.c_str());
+			return;
+		}
+		this->hot_set = bytes;
+		printf("Recorded cold start hot set (%lu kB) to '%s'\n",
+			(unsigned long)(bytes >> 10), filename.c_str());
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace kvm
+{
+	/* Cold start snapshots are mapped privately from their file, so
+	   a restored VM only faults in the pages that the guest touches.
+	   What is read ahead of those faults is decided before the VM is
+	   created: nothing (lazy), the pages that were touched after an
+	   earlier restore (hot set), or the whole file (eager). */
+	enum class ColdStartRestore : uint8_t { Lazy, HotSet, Eager };
+
+	struct ColdStart {
+		~ColdStart();
+		ColdStartRestore mode = ColdStartRestore::Lazy;
+		bool restored = false;
+		uint64_t prefetched = 0; /* Bytes */
+		uint64_t restore_time = 0; /* Nanoseconds */
+		std::atomic<uint64_t> hot_set {0}; /* Bytes */
+		/* Requests left until the hot set is recorded. */
+		std::atomic<int> record_countdown {0};
+
+		/* Read ahead the snapshot file before it is restored. Returns
+		   true when there is no hot set yet, and one should be recorded
+		   after the restore. Only a program that has the snapshot file
+		   to itself records a hot set, as that starts out by dropping
+		   the file from the page cache. */
+		bool prefetch(const std::string& snapshot);
+		/* Record the pages of the snapshot file that are resident, into
+		   the hot set file next to it. */
+		void record_hot_set(const std::string& snapshot);
+
+		static std::string hot_set_file(const std::string& snapshot) {
+			return snapshot + ".hotset";
+		}
+
+	private:
+		/* Count this program as a user of the snapshot file, returning
+		   true when it is the only one in this process. */
+		bool acquire(const std::string& snapshot);
+		std::string m_snapshot; /* Released when destroyed */
+	};
+}
@@ -91,8 +91,9 @@ struct Cache {
 	}
 
 	void reset_and_loan(const Cache& other) {
-		/* Clear out the cache and reset to other */
-		cache = {};
+		/* Clear out the cache and reset to other, keeping the
+		   capacity in order to not allocate during VM resets. */
+		cache.clear();
 		cache.reserve(other.max_entries());
 
 		/* Load the items of the other and make them non-owned */
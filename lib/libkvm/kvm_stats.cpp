@@ -8,8 +8,10 @@
  * Statistics around programs.
  * 
  */
+#include "binary_cache.hpp"
 #include "common_defs.hpp"
 #include "program_instance.hpp"
+#include "scoped_allocations.hpp"
 #include "scoped_duration.hpp"
 #include "serialized_state.hpp"
 #include "tenant_instance.hpp"
@@ -45,6 +47,8 @@ static auto gather_stats(const MachineInstance& mi, TT& taskq)
 		{"status_3xx",  stats.status_3xx},
 		{"status_4xx",  stats.status_4xx},
 		{"status_5xx",  stats.status_5xx},
+		{"heap_allocations",    stats.heap_allocations},
+		{"request_allocations", stats.request_allocations},
 		{"vm_address_space", mi.tenant().config.max_address()},
 		{"vm_main_memory",   mi.tenant().config.max_main_memory()},
 		{"vm_bank_capacity", mi.machine().banked_memory_capacity_bytes()},
@@ -53,6 +57,18 @@ static auto gather_stats(const MachineInstance& mi, TT& taskq)
 		{"tasks_queued",   taskq.racy_queue_size()}
 	});
 }
+static auto gather_latency(const ProgramInstance::Histogram& histogram)
+{
+	const auto snap = histogram.snapshot();
+
+	return nlohmann::json::object({
+		{"samples", snap.samples},
+		{"p50",  snap.percentile(0.5) * 1e-9},
+		{"p90",  snap.percentile(0.9) * 1e-9},
+		{"p99",  snap.percentile(0.99) * 1e-9},
+		{"p999", snap.percentile(0.999) * 1e-9},
+	});
+}
 static void gather_stats(VRT_CTX,
 	nlohmann::json& j, TenantInstance* tenant)
 {
@@ -81,6 +97,83 @@ static void gather_stats(VRT_CTX,
 		auto& storage = prog->storage();
 		auto stats = gather_stats(*storage.storage_vm, prog->m_storage_queue);
 		stats.push_back({"tasks_inschedule", prog->m_timer_system.racy_count()});
+		stats.push_back({"wait", gather_latency(storage.shards.front().wait)});
+		{
+			auto& tasks = storage.tasks;
+			stats["tasks"] = {
+				{"max_queued", tasks.max_queued},
+				{"coalesce",   tasks.coalesce},
+				{"tasks",      tasks.tasks.load()},
+				{"queued",     tasks.queued.load()},
+				{"running",    tasks.running.load()},
+				{"completed",  tasks.completed.load()},
+				{"failed",     tasks.failed.load()},
+				{"dropped",    tasks.dropped.load()},
+				{"coalesced",  tasks.coalesced.load()},
+				{"wait",       gather_latency(tasks.wait)},
+				{"run",        gather_latency(tasks.run)},
+			};
+		}
+		if (!storage.snapshot_file.empty()) {
+			const auto& snapshots = storage.snapshots;
+			stats["snapshot"] = {
+				{"restored",     snapshots.restored},
+				{"restore_time", snapshots.restore_time * 1e-9},
+				{"taken",        snapshots.taken.load()},
+				{"last_pause",   snapshots.last_pause.load() * 1e-9},
+				{"max_pause",    snapshots.max_pause.load() * 1e-9},
+			};
+		}
+
+		if (!storage.readers.empty()) {
+			const auto& reads = storage.reads;
+			stats["readers"] = {
+				{"views",      storage.readers.size()},
+				{"calls",      reads.calls.load()},
+				{"forks",      reads.forks.load()},
+				{"active",     reads.active.load()},
+				{"max_active", reads.max_active.load()},
+			};
+		}
+
+		if (storage.mailbox.enabled()) {
+			const auto& mstats = storage.mailbox.stats;
+			stats["mailbox"] = {
+				{"size",         storage.mailbox.size()},
+				{"reservations", mstats.reservations.load()},
+				{"full",         mstats.full.load()},
+				{"in_use",       mstats.in_use.load()},
+				{"max_in_use",   mstats.max_in_use.load()},
+				{"passed",       mstats.passed.load()},
+				{"in_place",     mstats.in_place.load()},
+			};
+		}
+
+		if (storage.batch_max > 1) {
+			const auto& batches = storage.batches;
+			stats["batches"] = {
+				{"max_calls", storage.batch_max},
+				{"batches",   batches.batches.load()},
+				{"calls",     batches.calls.load()},
+				{"max_size",  batches.max_size.load()},
+			};
+		}
+
+		if (storage.shards.size() > 1) {
+			auto shards = json::array();
+			for (const auto& shard : storage.shards) {
+				const auto& mi = (shard.vm != nullptr) ? *shard.vm : *storage.storage_vm;
+				shards.push_back(json::object({
+					{"calls",      shard.calls.load()},
+					{"queued",     shard.queued.load()},
+					{"max_queued", shard.max_queued.load()},
+					{"wait",       gather_latency(shard.wait)},
+					{"exceptions", mi.stats().exceptions},
+					{"request_cpu_time", mi.stats().request_cpu_time},
+				}));
+			}
+			stats["shards"] = std::move(shards);
+		}
 
 		obj["storage"] = {stats};
 	}
@@ -91,8 +184,14 @@ static void gather_stats(VRT_CTX,
 
 	/* Individual request VMs */
 	double total_resv_time = 0.0;
+	std::vector<size_t> pool_nodes(prog->num_nodes());
+	std::scoped_lock lock(prog->m_vms_mtx);
 	for (size_t i = 0; i < prog->m_vms.size(); i++)
 	{
+		/* Retired VMs in elastic pools have no machine. */
+		if (prog->m_vms[i].is_retired())
+			continue;
+		pool_nodes.at(prog->m_vms[i].node) ++;
 		auto& mi = *prog->m_vms[i].mi;
 		machines.push_back(gather_stats(mi, prog->m_vms[i].tp));
 
@@ -116,6 +215,8 @@ static void gather_stats(VRT_CTX,
 		totals.status_4xx += mi.stats().status_4xx;
 		totals.status_5xx += mi.stats().status_5xx;
 		totals.status_unknown += mi.stats().status_unknown;
+
+		totals.heap_allocations += mi.stats().heap_allocations;
 	}
 
 	requests["machines"] = std::move(machines);
@@ -137,6 +238,7 @@ static void gather_stats(VRT_CTX,
 		{"status_3xx",  totals.status_3xx},
 		{"status_4xx",  totals.status_4xx},
 		{"status_5xx",  totals.status_5xx},
+		{"heap_allocations", totals.heap_allocations},
 	}});
 
 	std::string binary_type;
@@ -146,9 +248,17 @@ static void gather_stats(VRT_CTX,
 		binary_type = "(not present)";
 	}
 
+	const auto& workmem = prog->working_memory();
+	const auto& cold_start = prog->cold_start();
+	static const char* cold_start_modes[] = {"lazy", "hotset", "eager"};
+	const long binary_sharers = BinaryCache::get().sharers(prog->request_binary);
 	obj["program"] = {
 		{"binary_type",  binary_type},
 		{"binary_size",  prog->request_binary.size()},
+		{"binary_sharers", binary_sharers},
+		/* Only the host copy of the binary is shared, not guest memory. */
+		{"binary_cache_shared_bytes",  binary_sharers > 1 ? prog->request_binary.size() : 0},
+		{"binary_cache_private_bytes", binary_sharers > 1 ? 0 : prog->request_binary.size()},
 		{"entry_points", {
 			{"on_recv", prog->state.entry_address[(size_t)ProgramEntryIndex::ON_RECV]},
 			{"backend_get", prog->state.entry_address[(size_t)ProgramEntryIndex::BACKEND_GET]},
@@ -164,6 +274,71 @@ static void gather_stats(VRT_CTX,
 		{"live_update_transfer_bytes", prog->stats.live_update_transfer_bytes},
 		{"reservation_time",     total_resv_time},
 		{"reservation_timeouts", prog->stats.reservation_timeouts},
+		{"reservation_wait_avg", prog->reservation_wait_ewma() * 1e-9},
+		{"service_time_avg", prog->service_time_ewma() * 1e-9},
+		{"requests_shed",    prog->stats.requests_shed},
+		{"pool_size",        prog->pool_size()},
+		{"pool_scale_ups",   prog->stats.pool_scale_ups},
+		{"pool_scale_downs", prog->stats.pool_scale_downs},
+		{"pool_nodes",       pool_nodes},
+		{"numa_steals",      prog->stats.numa_steals},
+		{"standby_forks",    prog->stats.standby_forks},
+		{"reset_handoffs",   prog->stats.reset_handoffs},
+		{"scale_to_zero",    prog->stats.scale_to_zero},
+		{"cold_restores",    prog->stats.cold_restores},
+		{"memory_reclaimed", prog->stats.memory_reclaimed},
+		{"budget_memory",    prog->budget_memory()},
+		{"budget_evictions", prog->stats.budget_evictions},
+		{"working_memory", {
+			{"adaptive",      workmem.adaptive},
+			{"limit",         workmem.limit.load()},
+			{"cap",           workmem.cap.load()},
+			{"peak",          workmem.peak.load()},
+			{"banked_avg",    workmem.banked_avg.load()},
+			{"refaulted_avg", workmem.refaulted_avg.load()},
+			{"reset_avg",     workmem.reset_avg.load() * 1e-9},
+			{"full_resets",   workmem.full_resets.load()},
+		}},
+		{"cold_start", {
+			{"mode",         cold_start_modes[(size_t)cold_start.mode]},
+			{"restored",     cold_start.restored},
+			{"restore_time", cold_start.restore_time * 1e-9},
+			{"prefetched",   cold_start.prefetched},
+			{"hot_set",      cold_start.hot_set.load()},
+		}},
+		{"warmup", {
+			{"requests",   prog->warmup.requests},
+			{"passes",     prog->warmup.passes},
+			{"duration",   prog->warmup.duration * 1e-9},
+			{"first_pass", prog->warmup.first_pass * 1e-9},
+			{"best_pass",  prog->warmup.best_pass * 1e-9},
+			{"improvement", prog->warmup.best_pass > 0
+				? double(prog->warmup.first_pass) / prog->warmup.best_pass : 0.0},
+		}},
+		{"snapshot_cache", prog->snapshot_entry().path.empty() ? "disabled"
+			: (prog->snapshot_entry().hit ? "hit" : "miss")},
+		{"heap_allocations_counted", ScopedAllocations::enabled()},
+		{"queue_depth", prog->queue_depth()},
+		{"vms_in_use",  prog->vms_in_use()},
+		{"vms_resetting", prog->vms_resetting()},
+		{"latency", {
+			{"reservation_wait", gather_latency(prog->latency.reservation_wait)},
+			{"vm_call", gather_latency(prog->latency.vm_call)},
+			{"reset",   gather_latency(prog->latency.reset)},
+			{"reset_incremental", gather_latency(prog->latency.reset_incremental)},
+			{"reset_full", gather_latency(prog->latency.reset_full)},
+			{"reset_completion", gather_latency(prog->latency.reset_completion)},
+			{"request", gather_latency(prog->latency.request)},
+			{"reservation_wait_interactive", gather_latency(
+				prog->latency.reservation_wait_by_priority[PRIORITY_INTERACTIVE])},
+			{"reservation_wait_default", gather_latency(
+				prog->latency.reservation_wait_by_priority[PRIORITY_DEFAULT])},
+			{"reservation_wait_background", gather_latency(
+				prog->latency.reservation_wait_by_priority[PRIORITY_BACKGROUND])},
+			{"cold_restore", gather_latency(prog->latency.cold_restore)},
+			{"prefault", gather_latency(prog->latency.prefault)},
+			{"first_request", gather_latency(prog->latency.first_request)},
+		}},
 	};
 
 }
@@ -12,6 +12,7 @@
 #include "program_instance.hpp"
 #include "tenant_instance.hpp"
 #include "varnish.hpp"
+#include <cstring>
 using namespace kvm;
 
 extern "C"
@@ -63,23 +64,32 @@ int kvm_tenant_unload(VRT_CTX, kvm::TenantInstance* tenant)
 }
 
 extern "C"
-kvm::VMPoolItem* kvm_reserve_machine(const vrt_ctx *ctx, kvm::TenantInstance* tenant, bool debug)
+kvm::VMPoolItem* kvm_reserve_machine(const vrt_ctx *ctx, kvm::TenantInstance* tenant, bool debug, int priority)
 {
 	if (UNLIKELY(tenant == nullptr || ctx == nullptr))
 		return nullptr;
 
 	/* Can block for a while until program is fetched and initialized. */
-	return tenant->vmreserve(ctx, debug);
+	return tenant->vmreserve(ctx, debug, priority);
 }
 
 extern "C"
-kvm::VMPoolItem* kvm_temporarily_reserve_machine(const vrt_ctx *ctx, kvm::TenantInstance* tenant, bool debug, bool soft_reset)
+kvm::VMPoolItem* kvm_temporarily_reserve_machine(const vrt_ctx *ctx, kvm::TenantInstance* tenant, bool debug, bool soft_reset, int priority)
 {
 	if (UNLIKELY(tenant == nullptr || ctx == nullptr))
 		return nullptr;
 
 	/* Can block for a while until program is fetched and initialized. */
-	return tenant->temporary_vmreserve(ctx, debug, soft_reset);
+	return tenant->temporary_vmreserve(ctx, debug, soft_reset, priority);
+}
+extern "C"
+int kvm_reservation_shed(unsigned* retry_after)
+{
+	/* Non-zero status when the last reservation was shed. */
+	uint32_t seconds = 0;
+	const int status = TenantInstance::last_shed_status(seconds);
+	*retry_after = seconds;
+	return status;
 }
 extern "C"
 void kvm_free_reserved_machine(const vrt_ctx *ctx, void* slot)
@@ -170,21 +180,32 @@ int kvm_synth(VRT_CTX, kvm::MachineInstance* machine,
 		bufcount = vm.gather_buffers_from_range(
 			bufcount, buffers, cvaddr, clen);
 
-		if (bufcount == 1) {
-			/* we need to get rid of the old data */
-			if (vsb->s_flags & VSB_DYNAMIC) {
-				free(vsb->s_buf);
-			}
-			vsb->s_buf = (char*) buffers[0].ptr;
-			vsb->s_size = buffers[0].len + 1; /* pretend-zero */
-			vsb->s_len  = buffers[0].len;
-			vsb->s_flags = VSB_FIXEDLEN;
-		} else {
+		if (bufcount == 0) {
 			VSB_clear(vsb);
+			return clen;
+		}
+		const char* data = (const char*) buffers[0].ptr;
+		if (bufcount > 1) {
+			/* Linearize into VM-owned scratch memory instead of
+			   growing the VSB, which lives as long as the VM is
+			   reserved, just like the zero-copy buffer. */
+			char* scratch = machine->scratch_buffer(clen + 1);
+			size_t offset = 0;
 			for (size_t i = 0; i < bufcount; i++) {
-				VSB_bcat(vsb, buffers[i].ptr, buffers[i].len);
+				std::memcpy(&scratch[offset], buffers[i].ptr, buffers[i].len);
+				offset += buffers[i].len;
 			}
+			scratch[offset] = 0;
+			data = scratch;
+		}
+		/* we need to get rid of the old data */
+		if (vsb->s_flags & VSB_DYNAMIC) {
+			free(vsb->s_buf);
 		}
+		vsb->s_buf = (char*) data;
+		vsb->s_size = clen + 1; /* pretend-zero */
+		vsb->s_len  = clen;
+		vsb->s_flags = VSB_FIXEDLEN;
 		return clen;
 	} catch (const std::exception& e) {
 		VRT_fail(ctx, "Invalid synth response: %s", e.what());
@@ -198,7 +219,7 @@ static int kvm_forkcall(VRT_CTX, kvm::VMPoolItem* slot,
 	auto& machine = *slot->mi;
 	machine.set_ctx(ctx);
 	try {
-		auto fut = slot->tp.enqueue(
+		return slot->call(
 		[&] () -> long {
 			auto& vm = machine.machine();
 			const auto timeout = machine.max_req_time();
@@ -210,7 +231,6 @@ static int kvm_forkcall(VRT_CTX, kvm::VMPoolItem* slot,
 			const auto& regs = vm.registers();
 			return regs.rdi;
 		});
-		return fut.get();
 
 	} catch (const tinykvm::MachineTimeoutException& mte) {
 		fprintf(stderr, "%s: KVM VM timed out (%f seconds)\n",
@@ -38,7 +38,7 @@ kvm_live_update(VRT_CTX, kvm::TenantInstance* ten, struct update_params *params)
 		std::vector<uint8_t> binary {params->data, params->data + params->len};
 
 		/* If this throws an exception, we instantly fail the update */
-		auto inst = std::make_shared<ProgramInstance>(
+		auto inst = ProgramInstance::make(
 			binary, binary, ctx, ten, params->is_debug);
 		const auto& live_binary = inst->request_binary;
 
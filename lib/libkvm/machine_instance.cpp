@@ -16,10 +16,12 @@
 #include "program_instance.hpp"
 #include "scoped_duration.hpp"
 #include "settings.hpp"
+#include "shared_objects.hpp"
 #include "tenant_instance.hpp"
 #include "timing.hpp"
 #include "varnish.hpp"
 #include <tinykvm/util/elf.h>
+#include <unistd.h>
 extern "C" {
 #include "kvm_backend.h"
 int close(int);
@@ -28,9 +30,8 @@ int close(int);
 namespace kvm {
 static BinaryStorage ld_linux_x86_64_so;
 extern std::vector<uint8_t> file_loader(const std::string &);
-extern void backend_warmup_pause_resume(MachineInstance& machine,
-	const struct kvm_chain_item *invoc,
-	const TenantGroup::Warmup& warmup);
+extern ProgramInstance::Warmup backend_warmup_pause_resume(MachineInstance& machine,
+	const TenantGroup::Warmup& warmup, bool single_pass);
 
 void MachineInstance::kvm_initialize()
 {
@@ -76,6 +77,16 @@ static std::span<const uint8_t> select_main_binary(const BinaryStorage& program_
 	return program_binary.binary();
 }
 
+/* Shared objects are loaded by the dynamic linker in the main VM.
+   Identical ones are opened through the same path (see SharedObjectCache),
+   so that their pages come from a single page cache entry. */
+static bool allow_shared_object(const TenantInstance& ten, std::string& path)
+{
+	if (ten.config.group.shared_library_cache)
+		SharedObjectCache::get().canonicalize(path);
+	return true;
+}
+
 static std::pair<uint64_t, uint64_t> get_urandom_state()
 {
 	FILE* urandom = fopen("/dev/urandom", "rb");
@@ -92,6 +103,12 @@ static std::pair<uint64_t, uint64_t> get_urandom_state()
 	return state;
 }
 
+/* Storage VMs have their own snapshots, see: storage_snapshot_file. */
+static const std::string& snapshot_file_of(ProgramInstance* inst, bool storage)
+{
+	return storage ? inst->storage().snapshot_file : inst->snapshot_file();
+}
+
 MachineInstance::MachineInstance(
 	const BinaryStorage& binary, const vrt_ctx* ctx,
 	const TenantInstance* ten, ProgramInstance* inst,
@@ -110,8 +127,8 @@ MachineInstance::MachineInstance(
 		.split_hugepages = false,
 		.relocate_fixed_mmap = ten->config.group.relocate_fixed_mmap,
 		.executable_heap = ten->config.group.vmem_heap_executable || is_interpreted_binary(binary),
-		.mmap_backed_files = ten->config.group.mmap_backed_files && (storage || ten->config.group.cold_start_snapshot_file.empty()),
-		.snapshot_file = ten->config.group.cold_start_snapshot_file,
+		.mmap_backed_files = ten->config.group.mmap_backed_files && snapshot_file_of(inst, storage).empty(),
+		.snapshot_file = snapshot_file_of(inst, storage),
 		.hugepages_arena_size = ten->config.group.hugepage_arena_size,
 	  }),
 	  m_tenant(ten), m_inst(inst),
@@ -143,11 +160,11 @@ MachineInstance::MachineInstance(
 			if (!tpath.prefix && tpath.virtual_path == path) {
 				// Rewrite the path to the allowed file
 				path = tpath.real_path;
-				return true;
+				return allow_shared_object(tenant(), path);
 			} else if (tpath.prefix && path.find(tpath.virtual_path) == 0) {
 				// If the path starts with the prefix, rewrite it
 				path = tpath.real_path + path.substr(tpath.virtual_path.size());
-				return true;
+				return allow_shared_object(tenant(), path);
 			}
 		}
 		if (path == "state") {
@@ -209,10 +226,23 @@ void MachineInstance::initialize()
 			throw std::runtime_error("Shared memory is currently incompatible with vmem remappings");
 		}
 
+		// Restore storage from its snapshot, including the allowed functions
+		if (is_storage() && !program().storage().snapshot_file.empty()
+			&& machine().has_snapshot_state())
+		{
+			if (!program().storage().load_state(machine().get_snapshot_state_user_area()))
+				throw std::runtime_error("Invalid storage snapshot state");
+			printf("Loaded storage state from: %s\n",
+				program().storage().snapshot_file.c_str());
+			this->wait_for_requests();
+			this->prepare_storage_readers(shared_memory_boundary());
+			return;
+		}
+
 		// Check if fast cold start file is used, and if so load the state
 		if (!is_storage() && machine().has_snapshot_state()) {
 			printf("Loaded cold start state from: %s\n",
-				tenant().config.group.cold_start_snapshot_file.c_str());
+				program().snapshot_file().c_str());
 			// Load the programs state as well
 			program().load_state(machine().get_snapshot_state_user_area());
 			// Set as waiting for requests
@@ -298,14 +328,20 @@ void MachineInstance::initialize()
 			// Make forkable (with *NO* working memory)
 			machine().prepare_copy_on_write(0UL, shm_boundary);
 		}
+		else
+		{
+			this->prepare_storage_readers(shm_boundary);
+		}
 
 		// If fast cold start file is used, we should store the VM state as well
-		if (!is_storage() && !tenant().config.group.cold_start_snapshot_file.empty()) {
+		if (!is_storage() && !program().snapshot_file().empty()) {
 			machine().save_snapshot_state_now();
 			// Save program state as well
 			program().save_state(machine().get_snapshot_state_user_area());
+			// A hot set recorded for the previous snapshot is stale
+			unlink(ColdStart::hot_set_file(program().snapshot_file()).c_str());
 			printf("Saved cold start state to '%s'\n",
-				tenant().config.group.cold_start_snapshot_file.c_str());
+				program().snapshot_file().c_str());
 		}
 
 		// If verbose pagetables, print them after running
@@ -339,34 +375,60 @@ void MachineInstance::initialize()
 	}
 }
 
+void MachineInstance::prepare_storage_readers(uint64_t shm_boundary)
+{
+	// Storage with read-only functions is forked into views that run
+	// them. With direct memory writes, storage keeps writing to the
+	// memory that the views share. Other storage shards have no views.
+	if (tenant().config.group.storage_readers > 0
+		&& program().storage().storage_vm.get() == this
+		&& !program().storage().readonly_list.empty() && !is_debug())
+	{
+		machine().prepare_copy_on_write(0UL, shm_boundary);
+	}
+}
+
 void MachineInstance::warmup()
+{
+	this->run_warmup(false);
+}
+
+void MachineInstance::prefault()
+{
+	try {
+		this->run_warmup(true);
+	} catch (const std::exception&) {
+		// The fork is still usable, after a full reset
+		this->m_reset_needed = true;
+	}
+	this->reset_to(nullptr, *program().main_vm);
+}
+
+void MachineInstance::run_warmup(bool single_pass)
 {
 	if (!tenant().config.group.warmup)
 		throw std::runtime_error("Warmup has not been enabled");
-	auto& w = *tenant().config.group.warmup;
-	if (w.url.empty())
-		throw std::runtime_error("Warmup URL is empty");
-	if (w.method.empty())
-		throw std::runtime_error("Warmup method is empty");
-
-	kvm_chain_item invoc;
-	invoc.tenant = (struct vmod_kvm_tenant *)this->m_tenant;
-	invoc.inputs.method = w.method.c_str();
-	invoc.inputs.url = w.url.c_str();
-	invoc.inputs.argument = "";
-	invoc.inputs.content_type = "";
-	if (this->tenant().config.group.verbose) {
+	const auto& w = *tenant().config.group.warmup;
+	if (this->tenant().config.group.verbose && !w.requests.empty()) {
+		if (!w.corpus.empty()) {
+			printf("Warmup corpus: %s (%zu requests)\n",
+				w.corpus.c_str(), w.requests.size());
+		}
+		const auto& request = w.requests.front();
 		printf("Warmup request: HTTP/1.1 %s %s\n",
-			invoc.inputs.method, invoc.inputs.url);
+			request.method.c_str(), request.url.c_str());
 		printf("Warmup headers:\n");
-		for (const auto& header : w.headers) {
+		for (const auto& header : request.headers) {
 			printf("- %s\n", header.c_str());
 		}
 	}
 
 	this->m_is_warming_up = true;
 	try {
-		backend_warmup_pause_resume(*this, &invoc, w);
+		const auto result = backend_warmup_pause_resume(*this, w, single_pass);
+		// Only the warmup of the main VM is reported
+		if (!single_pass)
+			program().warmup = result;
 	} catch (const std::exception& e) {
 		this->m_is_warming_up = false;
 		fprintf(stderr,
@@ -392,7 +454,7 @@ MachineInstance::MachineInstance(
 	  m_tenant(ten), m_inst(inst),
 	  m_original_binary(source.m_original_binary),
 	  m_is_debug(source.is_debug()),
-	  m_is_storage(false),
+	  m_is_storage(source.is_storage()), // Views of storage
 	  m_is_ephemeral(source.is_ephemeral()),
 	  m_waiting_for_requests(true), // If we got this far, we are waiting...
 	  m_binary_type(source.binary_type()),
@@ -456,6 +518,16 @@ void MachineInstance::tail_reset()
 		[] (auto& entry) {
 			VRE_free(&entry.item);
 		});
+	/* Large scratch memory is not kept for the lifetime of the VM */
+	if (this->m_scratch.capacity() > SCRATCH_RETAIN_SIZE) {
+		std::vector<char>().swap(this->m_scratch);
+	}
+	/* Release buffers reserved in the storage mailbox */
+	if (!this->is_storage() && program().has_storage()
+		&& program().storage().mailbox.enabled())
+	{
+		program().storage().mailbox.release(this);
+	}
 	if (this->is_debug()) {
 		//this->stop_debugger();
 	}
@@ -481,7 +553,7 @@ void MachineInstance::reset_to(const vrt_ctx* ctx,
 			const bool full_reset = machine().reset_to(source.machine(), {
 				.max_mem = tenant().config.max_main_memory(),
 				.max_cow_mem = tenant().config.max_req_memory(),
-				.reset_free_work_mem = tenant().config.limit_req_memory(),
+				.reset_free_work_mem = program().workmem_limit(),
 				.reset_copy_all_registers = true,
 				// When m_reset_needed is true, we want to do a full reset
 				.reset_keep_all_work_memory = !this->m_reset_needed && tenant().config.group.ephemeral_keep_working_memory,
@@ -607,6 +679,14 @@ uint64_t MachineInstance::allocate_post_data(size_t bytes)
 	}
 	return this->m_post_data;
 }
+char* MachineInstance::scratch_buffer(size_t bytes)
+{
+	/* Kept between requests up to SCRATCH_RETAIN_SIZE (see tail_reset),
+	   so that steady-state requests don't allocate. */
+	if (this->m_scratch.size() < bytes)
+		this->m_scratch.resize(bytes);
+	return this->m_scratch.data();
+}
 
 void MachineInstance::print(std::string_view text) const
 {
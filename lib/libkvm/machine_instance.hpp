@@ -100,6 +100,11 @@ public:
 
 	uint64_t allocate_post_data(size_t size);
 	gaddr_t& get_inputs_allocation() { return m_inputs_allocation; }
+	/* Scratch memory owned by this VM, re-used between requests.
+	   Valid until the VM is reset. */
+	char* scratch_buffer(size_t size);
+	/* Heap allocations made on behalf of the current request. */
+	uint64_t& request_allocations() noexcept { return m_request_allocations; }
 	uint64_t rand_uint64() { return m_prng.randU64(); }
 
 	static void kvm_initialize();
@@ -107,12 +112,19 @@ public:
 	MachineInstance(unsigned reqid, const MachineInstance&, const TenantInstance*, ProgramInstance*);
 	void initialize();
 	void warmup();
+	/* Run one pass over the warmup requests in a forked VM, and reset it
+	   while keeping its working memory. The pages written on the request
+	   path are then already private to the fork when it serves its first
+	   request. */
+	void prefault();
 	~MachineInstance();
 	void tail_reset();
 	void reset_to(const vrt_ctx*, MachineInstance&);
 
 private:
 	static void setup_syscall_interface();
+	void run_warmup(bool single_pass);
+	void prepare_storage_readers(uint64_t shm_boundary);
 	void handle_exception(gaddr_t);
 	void handle_timeout(gaddr_t);
 	void sanitize_path(char*, size_t);
@@ -140,6 +152,9 @@ private:
 	size_t      m_post_size = 0;
 	gaddr_t     m_inputs_allocation = 0x0;
 
+	std::vector<char> m_scratch;
+	uint64_t    m_request_allocations = 0;
+
 	MachineStats m_stats;
 
 	Cache<vre*> m_regex;
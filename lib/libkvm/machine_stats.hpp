@@ -25,6 +25,10 @@ struct MachineStats
 
 	uint64_t input_bytes  = 0;
 	uint64_t output_bytes = 0;
+
+	/* Only counted when an allocation hook is present. */
+	uint64_t heap_allocations    = 0;
+	uint64_t request_allocations = 0; /* During the last request. */
 };
 
 } // kvm
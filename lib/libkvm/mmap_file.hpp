@@ -52,6 +52,11 @@ struct MmapFile
 	{
 		return m_filename;
 	}
+	/* Number of copies sharing the mapping. */
+	long use_count() const noexcept
+	{
+		return m_mapping.use_count();
+	}
 
 	MmapFile(const std::string& filename);
 	MmapFile(const MmapFile& other) = default;
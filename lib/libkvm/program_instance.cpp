@@ -20,22 +20,34 @@
  * 
 **/
 #include "program_instance.hpp"
+#include "binary_cache.hpp"
+#include "budget.hpp"
 
 #include "curl_fetch.hpp"
 #include "settings.hpp"
 #include "tenant_instance.hpp"
+#include "scoped_allocations.hpp"
 #include "scoped_duration.hpp"
 #include "timing.hpp"
+#include "utils/crc32.hpp"
+#include "utils/numa.hpp"
 #include "varnish.hpp"
 #include <cstring>
 #include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 #include <tinykvm/rsp_client.hpp>
 #include <sched.h>
 #include <unistd.h>
 extern "C" {
 #include "vtim.h"
 extern int usleep(uint32_t usec);
-extern int numa_max_node();
+void kvm_varnishstat_queue_depth(int64_t delta);
+void kvm_varnishstat_vms_in_use(int64_t delta);
+void kvm_varnishstat_requests_shed();
+void kvm_varnishstat_latency(const uint64_t reservation_wait[4], const uint64_t request[4]);
 }
 namespace kvm {
 extern std::vector<uint8_t> file_loader(const std::string&);
@@ -45,26 +57,185 @@ extern bool file_writer(const std::string& file, const std::vector<uint8_t>&);
 extern void extract_programs_to(kvm::ProgramInstance&, const char *, size_t);
 static constexpr bool VERBOSE_STORAGE_TASK = false;
 static constexpr bool VERBOSE_PROGRAM_STARTUP = false;
-
-VMPoolItem::VMPoolItem(unsigned reqid, const MachineInstance& main_vm,
-	TenantInstance* ten, ProgramInstance* prog)
-	: mi {nullptr},
+/* Latencies of all programs, published as VSC counters. */
+static ProgramInstance::Histogram g_reservation_wait;
+static ProgramInstance::Histogram g_request_latency;
+/* Set on the dedicated threads of request VMs */
+static thread_local bool t_request_vm_thread = false;
+
+VMPoolItem::VMPoolItem(unsigned id, unsigned numa_node,
+	const MachineInstance& main_vm, const TenantInstance* ten, ProgramInstance* prog)
+	: reqid {id},
+	  node {numa_node},
+	  mi {nullptr},
 	  tp {REQUEST_VM_NICE, false}
 {
+	this->task_future = this->fork(main_vm, ten, prog);
+}
+VMPoolItem::~VMPoolItem()
+{
+	this->stop_handoff();
+}
+std::future<long> VMPoolItem::fork(const MachineInstance& main_vm,
+	const TenantInstance* ten, ProgramInstance* prog)
+{
+	// The thread must be free to accept the fork task
+	this->stop_handoff();
 	// Spawn forked VM on dedicated thread, blocking.
 	// XXX: We are deliberately not catching exceptions here.
-	this->task_future = tp.enqueue(
-	[this, reqid, &main_vm, ten, prog] () -> long {
+	auto future = tp.enqueue(
+	[this, &main_vm, ten, prog] () -> long {
+		t_request_vm_thread = true;
+		// Bind the thread and the forks memory to the VMs node
+		if (prog->num_nodes() > 1)
+			NumaTopology::get().bind_thread(this->node);
 		this->mi = std::make_unique<MachineInstance> (
-			reqid, main_vm, ten, prog);
+			this->reqid, main_vm, ten, prog);
+		this->served = false;
+		// Take the copy-on-write faults of the request path here,
+		// instead of during the first request of the fork.
+		const auto& group = ten->config.group;
+		if (group.warmup && group.warmup->prefault && group.ephemeral_keep_working_memory) {
+			const uint64_t t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+			this->mi->prefault();
+			prog->latency.prefault.record(ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0);
+		}
 		return 0;
 	});
+	// Calls only spin before sleeping with low-latency handoff
+	this->handoff.set_spinning(ten->config.group.low_latency_handoff);
+	this->start_handoff();
+	return future;
+}
+void VMPoolItem::start_handoff()
+{
+	// Park the thread in the handoff loop after any queued tasks.
+	// From then on, all calls into this VM go through the handoff,
+	// which unlike the thread pool queue allocates nothing per call.
+	this->handoff_future = tp.enqueue(
+	[this] () -> long {
+		this->handoff.run();
+		return 0;
+	});
+	this->handoff_active = true;
+}
+void VMPoolItem::stop_handoff()
+{
+	if (!this->handoff_active)
+		return;
+	this->handoff_active = false;
+	this->handoff.stop();
+	this->handoff_future.get();
+}
+void VMPoolItem::retire(std::mutex& mtx)
+{
+	this->stop_handoff();
+	std::unique_ptr<MachineInstance> machine;
+	{
+		std::scoped_lock lock(mtx);
+		machine = std::move(this->mi);
+	}
+	// The VM is destroyed on its own thread, just like it was created.
+	tp.enqueue(
+	[&machine] () -> long {
+		machine = nullptr;
+		return 0;
+	}).get();
+}
+
+StorageReader::StorageReader(unsigned id)
+	: reqid{id},
+	  tp {STORAGE_VM_NICE, false}
+{
+}
+
+StorageShard::StorageShard(unsigned idx)
+	: index{idx}
+{
+}
+uint64_t StorageShard::enqueued() noexcept
+{
+	const int depth = ++this->queued;
+	int max_depth = max_queued.load(std::memory_order_relaxed);
+	while (depth > max_depth && !max_queued.compare_exchange_weak(max_depth, depth));
+	this->calls ++;
+	return ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+}
+void StorageShard::dequeued(uint64_t t0) noexcept
+{
+	this->queued --;
+	this->wait.record(ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0);
 }
 
 Storage::Storage(BinaryStorage storage_elf)
 	: storage_binary{std::move(storage_elf)}
 {
+	// The storage VM is always the first shard
+	shards.emplace_back(0);
 }
+long Storage::task_result(uint64_t id, long& result)
+{
+	std::scoped_lock lock(tasks.mtx);
+	for (const auto& res : tasks.results) {
+		if (res.id == id) {
+			result = res.result;
+			return res.status;
+		}
+	}
+	// Tasks run in the order they were queued, so every task newer
+	// than the last result is either queued or running.
+	const uint64_t last = tasks.results.empty() ? 0 : tasks.results.back().id;
+	if (id > last && id < tasks.next_id)
+		return 0;
+	return -2;
+}
+void Storage::save_state(void* state_area) const
+{
+	if (!state_area) {
+		throw std::runtime_error("Invalid state area");
+	}
+	SerializedStorageState storage_state;
+	for (const uint64_t address : allow_list) {
+		if (storage_state.allowed_count == storage_state.allowed.size())
+			throw std::runtime_error("Too many allowed storage functions");
+		if (is_readonly(address))
+			storage_state.readonly_mask |= 1ull << storage_state.allowed_count;
+		storage_state.allowed[storage_state.allowed_count++] = address;
+	}
+	storage_state.batch_entry = batch_entry;
+	storage_state.mailbox_base = mailbox.base();
+	storage_state.mailbox_size = mailbox.size();
+	memcpy(state_area, &storage_state, sizeof(storage_state));
+}
+bool Storage::load_state(const void* state_area)
+{
+	if (!state_area) {
+		fprintf(stderr, "Invalid state area\n");
+		return false;
+	}
+	SerializedStorageState storage_state;
+	memcpy(&storage_state, state_area, sizeof(storage_state));
+	if (storage_state.allowed_count > storage_state.allowed.size())
+		return false;
+	allow_list.clear();
+	allow_list.insert(storage_state.allowed.begin(),
+		storage_state.allowed.begin() + storage_state.allowed_count);
+	readonly_list.clear();
+	for (uint32_t i = 0; i < storage_state.allowed_count; i++) {
+		if (storage_state.readonly_mask & (1ull << i))
+			readonly_list.insert(storage_state.allowed[i]);
+	}
+	batch_entry = storage_state.batch_entry;
+	if (storage_state.mailbox_size != 0)
+		mailbox.init(storage_state.mailbox_base, storage_state.mailbox_size);
+	return true;
+}
+
+/* Storage snapshot files, and the program currently snapshotting to
+   each of them. A new program with the same file, eg. after a live
+   update, takes it over and the old program stops snapshotting. */
+static std::mutex g_storage_snapshot_mtx;
+static std::unordered_map<std::string, const ProgramInstance*> g_storage_snapshot_owners;
 
 ProgramInstance::ProgramInstance(
 	BinaryStorage request_elf,
@@ -241,17 +412,56 @@ ProgramInstance::ProgramInstance(
 void ProgramInstance::begin_initialization(const vrt_ctx *ctx, TenantInstance *ten, bool debug)
 {
 	try {
-		const size_t max_vms = ten->config.group.max_concurrency;
+		/* Elastic pools start out small and grow on demand. */
+		const size_t max_vms = ten->config.group.initial_concurrency();
 		if (max_vms < 1)
 			throw std::runtime_error("Concurrency must be at least 1");
+		this->m_elastic_pool = ten->config.group.is_elastic();
+		this->m_lifo_handoff = ten->config.group.lifo_handoff;
+		this->m_num_nodes = std::min(NumaTopology::get().num_nodes(), m_vmqueue.size());
+		const unsigned n_nodes = this->m_num_nodes;
+		this->m_pool_tenant = ten;
+		{
+			const auto& group = ten->config.group;
+			// A zero limit means no limit, like in tinykvm
+			const uint64_t cap = (group.limit_req_mem != 0)
+				? std::min(uint64_t(group.limit_req_mem), uint64_t(group.max_req_mem))
+				: uint64_t(group.max_req_mem);
+			this->m_workmem.adaptive = group.adaptive_working_memory && group.ephemeral;
+			this->m_workmem.cap = cap;
+			this->m_workmem.limit = m_workmem.adaptive ? cap : group.limit_req_mem;
+		}
 
 		/* Download any dependencies required by the program */
 		const uint64_t dl_millis = this->download_dependencies(ten) / 1e6;
 
+		/* Commit main memory (including storage) to the global budget,
+		   which is released again when the program is destroyed. */
+		const auto& group = ten->config.group;
+		this->m_vm_budget = group.max_req_mem + group.hugepage_requests_arena;
+		const uint64_t main_budget = group.max_main_memory * (this->has_storage() ? 1 + group.storage_shards : 1)
+			+ group.hugepage_arena_size;
+		if (!this->budget_commit(main_budget, 0) || !this->budget_commit(m_vm_budget, 1))
+			throw std::runtime_error("Program does not fit in the global budget");
+
+		// Programs loading identical binaries share a single copy
+		this->request_binary = BinaryCache::get().deduplicate(std::move(this->request_binary), this);
+		if (this->has_storage())
+			storage().storage_binary = BinaryCache::get().deduplicate(std::move(storage().storage_binary), this);
+
 		TIMING_LOCATION(t0);
 
 		if (this->has_storage())
 		{
+			// Storage VMs can be restored from their own snapshots,
+			// unless storage is spread across shards
+			if (!group.storage_snapshot_file.empty() && group.storage_shards == 1 && !debug)
+				this->prepare_storage_snapshot(group.storage_snapshot_file);
+			const uint64_t storage_t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+			// Storage tasks queued by main are bounded too
+			storage().tasks.max_queued = group.storage_task_queue;
+			storage().tasks.coalesce = group.storage_task_coalesce;
+
 			// 1. Create the storage VM, used for shared mutable storage.
 			storage().storage_vm = std::make_unique<MachineInstance>
 				(storage().storage_binary, ctx, ten, this, true, debug);
@@ -260,10 +470,52 @@ void ProgramInstance::begin_initialization(const vrt_ctx *ctx, TenantInstance *t
 			storage().storage_vm->initialize();
 			// We do not need a VRT CTX after initialization.
 			storage().storage_vm->set_ctx(nullptr);
+
+			if (!storage().snapshot_file.empty()) {
+				auto& snapshots = storage().snapshots;
+				const uint64_t now = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+				if (storage().storage_vm->machine().has_snapshot_state()) {
+					snapshots.restored = true;
+					snapshots.restore_time = now - storage_t0;
+				} else {
+					this->storage_snapshot(true);
+				}
+				snapshots.next_due = now + uint64_t(group.storage_snapshot_interval_ms) * 1'000'000;
+			}
+			// Buffers shared by requests and storage, before any views
+			if (group.storage_mailbox > 0 && !debug)
+				this->start_storage_mailbox(group.storage_mailbox);
+			// Storage calls waiting for storage are run in batches
+			if (group.storage_batch > 1 && storage().batch_entry != 0 && !debug)
+				storage().batch_max = group.storage_batch;
+			// Read-only storage calls run on forked views of storage
+			if (group.storage_readers > 0 && !storage().readonly_list.empty() && !debug)
+				this->start_storage_readers(group.storage_readers);
+			// Keyed storage calls are spread across independent storage VMs
+			if (group.storage_shards > 1 && !debug)
+				this->start_storage_shards(ctx, ten, group.storage_shards);
 			// Make most memory pages unneeded, lowering RSS
 			storage().storage_binary.dontneed();
 		}
 
+		// Programs without a cold start file may use the snapshot cache,
+		// which restores identical programs from the same snapshot.
+		this->m_snapshot_file = group.cold_start_snapshot_file;
+		if (m_snapshot_file.empty() && group.snapshot_cache && !this->has_storage() && !debug) {
+			m_snapshot_entry = SnapshotCache::get().lookup(ten, this->request_binary);
+			this->m_snapshot_file = m_snapshot_entry.path;
+		}
+
+		// Read ahead an existing cold start snapshot, as configured.
+		// The snapshot is otherwise faulted in as the guest touches it.
+		const std::string& snapshot = this->m_snapshot_file;
+		const uint64_t restore_t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+		bool record_hot_set = false;
+		if (!snapshot.empty()) {
+			m_cold_start.mode = group.cold_start_restore;
+			record_hot_set = m_cold_start.prefetch(snapshot);
+		}
+
 		// 2. Create the master VM, forked later for request concurrency.
 		// NOTE: The request VM can make calls into the storage VM, so
 		// we need to initialize storage first!
@@ -288,6 +540,17 @@ void ProgramInstance::begin_initialization(const vrt_ctx *ctx, TenantInstance *t
 		main_vm->initialize();
 		// We do not need a VRT CTX after initialization.
 		main_vm->set_ctx(nullptr);
+		// A new snapshot was saved after initialization (and warmup)
+		if (!m_snapshot_entry.path.empty() && !m_snapshot_entry.hit) {
+			SnapshotCache::get().store(m_snapshot_entry);
+			this->m_snapshot_file = m_snapshot_entry.path;
+		}
+		if (!snapshot.empty() && main_vm->machine().has_snapshot_state()) {
+			m_cold_start.restored = true;
+			m_cold_start.restore_time = ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - restore_t0;
+			if (record_hot_set)
+				m_cold_start.record_countdown = COLD_START_HOT_SET_REQUESTS;
+		}
 
 		// If we are using an epoll server, we'll need to start it now
 		if (ten->config.group.has_epoll_system()) {
@@ -315,42 +578,65 @@ void ProgramInstance::begin_initialization(const vrt_ctx *ctx, TenantInstance *t
 		// Instantiate first forked VM
 		// XXX: This can fail and throw an exception,
 		// think *long and hard* about the consequences!
-		m_vms.emplace_back(0, *main_vm, ten, this);
+		m_vms.emplace_back(0, 0, *main_vm, ten, this);
 
 		// Make sure the first VM is up and running before queueing
 		m_vms.front().task_future.get();
-		m_vmqueue[0].enqueue(&m_vms.front());
+		this->enqueue_vm(&m_vms.front());
 
 		// Start accepting incoming requests on thread pool.
 		this->unlock_and_initialized(true);
 
 		TIMING_LOCATION(t2);
 
-		// Instantiate remaining concurrency
-		for (size_t i = 1; i < max_vms; i++) {
-			m_vms.emplace_back(i, *main_vm, ten, this);
+		// Instantiate remaining concurrency, as far as the budget allows
+		size_t budgeted_vms = 1;
+		while (budgeted_vms < max_vms && this->budget_commit(m_vm_budget, 1))
+			budgeted_vms ++;
+		if (budgeted_vms < max_vms && ctx->vsl != nullptr)
+			VSLb(ctx->vsl, SLT_VCL_Error,
+				"%s: Global budget only allows %zu of %zu request machines",
+				ten->config.name.c_str(), budgeted_vms, max_vms);
+		{
+			std::scoped_lock lock(m_vms_mtx);
+			for (size_t i = 1; i < budgeted_vms; i++) {
+				m_vms.emplace_back(i, i % n_nodes, *main_vm, ten, this);
+			}
 		}
 
-#ifdef VARNISH_PLUS
-		const unsigned n_nodes = std::min(size_t(1) + numa_max_node(), m_vmqueue.size());
-#else
-		constexpr unsigned n_nodes = 1;
-#endif
 		size_t initialized = 1;
 		// Wait for all the VMs to start running
 		for (size_t i = 1; i < m_vms.size(); i++) {
 			try {
 				auto& vm = m_vms[i];
 				vm.task_future.get();
-				m_vmqueue[i % n_nodes].enqueue(&vm);
+				this->enqueue_vm(&vm);
 				initialized ++;
 			} catch (const std::exception& e) {
+				this->budget_release(m_vm_budget, 1);
 				if (ctx->vsl != nullptr)
 				VSLb(ctx->vsl, SLT_VCL_Error,
 					"%s: Failed to create all request machines, init=%zu",
 					ten->config.name.c_str(), initialized);
 			}
 		}
+		this->m_pool_size = initialized;
+		this->m_last_reserved = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+
+		// Elastic, standby, scale-to-zero and budgeted pools are resized by a periodic timer
+		if (this->m_elastic_pool || group.standby_vms > 0
+			|| group.scale_to_zero_ms > 0 || Budget::get().enabled()) {
+			const auto interval = std::chrono::milliseconds(POOL_AUTOSCALE_INTERVAL_MS);
+			m_pool_timer = std::make_unique<cpptime::TimerSystem>();
+			m_pool_timer->add(interval,
+			[this, ten] (auto) {
+				if (this->m_elastic_pool)
+					this->pool_autoscale(ten);
+				if (ten->config.group.standby_vms > 0)
+					this->pool_standby(ten);
+				this->pool_scale_to_zero(ten);
+			}, interval);
+		}
 
 		(void) t1;
 		std::string download_time = "";
@@ -372,12 +658,43 @@ void ProgramInstance::begin_initialization(const vrt_ctx *ctx, TenantInstance *t
 		// program fails to intialize.
 		main_vm = nullptr;
 		m_storage = nullptr;
+		SnapshotCache::get().discard(m_snapshot_entry);
 		this->unlock_and_initialized(false);
 		throw;
 	}
 }
+void ProgramInstance::destroy(ProgramInstance* prog)
+{
+	if (!t_request_vm_thread) {
+		delete prog;
+		return;
+	}
+	// The last reference was dropped by a request VM, eg. at the end of
+	// a deferred reset after a live update. Destroying the program here
+	// would destroy the VM thread and the handoff loop that is still
+	// running the reset, so the program is destroyed on another thread.
+	static moodycamel::BlockingConcurrentQueue<ProgramInstance*> queue;
+	static std::once_flag started;
+	std::call_once(started, [] {
+		std::thread([] {
+			for (;;) {
+				ProgramInstance* prog = nullptr;
+				queue.wait_dequeue(prog);
+				delete prog;
+			}
+		}).detach();
+	});
+	queue.enqueue(prog);
+}
+
 ProgramInstance::~ProgramInstance()
 {
+	/* Stop pool maintenance before anything else. Evictions can no
+	   longer reach this program, as its references are gone. */
+	Budget::get().remove_program(this);
+	BinaryCache::get().release(this);
+	m_pool_timer = nullptr;
+
 	/* Finish starting any request VMs and ignore exceptions. */
 	for (size_t i = 1; i < m_vms.size(); i++) {
 		auto& vm = m_vms[i];
@@ -395,9 +712,43 @@ ProgramInstance::~ProgramInstance()
 		m_websocket_systems->stop();
 	}
 
+	// A final snapshot of storage, after any queued storage calls
+	if (m_storage && storage().storage_vm && !storage().snapshot_file.empty()) {
+		m_storage_queue.enqueue([this] () -> long {
+			return this->storage_snapshot(false);
+		});
+	}
+
 	// NOTE: Thread pools need to wait on jobs here
 	m_storage_queue.wait_until_empty();
 	m_storage_queue.wait_until_nothing_in_flight();
+
+	// Storage views and shards are destroyed on their own threads
+	if (m_storage) {
+		for (auto& reader : storage().readers) {
+			reader.tp.enqueue([&reader] () -> long {
+				reader.mi = nullptr;
+				return 0;
+			}).get();
+		}
+		for (auto& shard : storage().shards) {
+			if (shard.queue == nullptr)
+				continue;
+			shard.queue->enqueue([&shard] () -> long {
+				shard.vm = nullptr;
+				return 0;
+			}).get();
+		}
+	}
+
+	if (m_storage && !storage().snapshot_file.empty()) {
+		std::scoped_lock lock(g_storage_snapshot_mtx);
+		auto it = g_storage_snapshot_owners.find(storage().snapshot_file);
+		if (it != g_storage_snapshot_owners.end() && it->second == this)
+			g_storage_snapshot_owners.erase(it);
+	}
+
+	Budget::get().release(m_budget_memory, m_budget_vms);
 }
 
 long ProgramInstance::wait_for_initialization()
@@ -491,22 +842,53 @@ void ProgramInstance::set_entry_at(const int idx, gaddr_t addr)
 
 Reservation ProgramInstance::reserve_vm(const vrt_ctx* ctx,
 	TenantInstance* ten, std::shared_ptr<ProgramInstance> prog,
-	bool soft_reset)
+	bool soft_reset, unsigned priority)
 {
 	const auto tmo = std::chrono::seconds(ten->config.group.max_queue_time);
 	VMPoolItem* slot = nullptr;
 	auto t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	if (UNLIKELY(priority >= NUM_PRIORITIES))
+		priority = NUM_PRIORITIES - 1;
+	// Only written every millisecond, to keep the cache line shared
+	if (t0 > m_last_reserved.load(std::memory_order_relaxed) + 1'000'000)
+		m_last_reserved.store(t0, std::memory_order_relaxed);
 	{
 		// Fixate on current NUMA node, for performance reasons.
-		int node = numa_node();
-		if (UNLIKELY(!m_vmqueue[node].wait_dequeue_timed(slot, tmo))) {
-			prog->stats.reservation_timeouts ++; /* Racy, but uncontended */
-			throw std::runtime_error("Queue timeout");
+		const unsigned node = numa_node();
+		// Free VMs are only taken directly when nobody is queued,
+		// so that the lanes decide the order under contention.
+		if (m_lane_waiters.load(std::memory_order_relaxed) == 0) {
+			// Prefer the most recently released VM
+			if (this->m_lifo_handoff)
+				slot = m_hot_vm[node].vm.exchange(nullptr);
+			if (slot == nullptr)
+				slot = try_dequeue_vm(node);
+		}
+		if (slot == nullptr) {
+			this->admission_control(ten);
+			slot = wait_for_vm(ten, node, priority, tmo);
+			if (UNLIKELY(slot == nullptr)) {
+				prog->stats.reservation_timeouts ++; /* Racy, but uncontended */
+				throw std::runtime_error("Queue timeout");
+			}
 		}
 		assert(slot && ctx);
 	}
 	/* Time spent reserving this VM. */
-	slot->mi->stats().reservation_time += (ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0) * 1e-9;
+	const uint64_t wait_ns = ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0;
+	slot->mi->stats().reservation_time += wait_ns * 1e-9;
+	this->latency.reservation_wait.record(wait_ns);
+	this->latency.reservation_wait_by_priority[priority].record(wait_ns);
+	g_reservation_wait.record(wait_ns);
+	slot->reserved_at = t0;
+	slot->in_pool.store(false, std::memory_order_relaxed);
+	this->m_vms_in_use.fetch_add(1, std::memory_order_relaxed);
+	kvm_varnishstat_vms_in_use(1);
+	if (this->m_elastic_pool) {
+		/* Moving average with alpha = 1/8. Racy, but lost samples are fine. */
+		const uint64_t ewma = m_resv_wait_ewma.load(std::memory_order_relaxed);
+		m_resv_wait_ewma.store(ewma - ewma / 8 + wait_ns / 8, std::memory_order_relaxed);
+	}
 
 	/* Set the new active VRT CTX. */
 	slot->mi->set_ctx(ctx);
@@ -529,38 +911,839 @@ void ProgramInstance::vm_free_function(VRT_CTX, void* slotv)
 #endif
 	auto* slot = (VMPoolItem *)slotv;
 
+	slot->reset_queued_at = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
 	const bool is_reset_needed = slot->mi->is_reset_needed();
 	if (!is_reset_needed) {
-		auto& mi = *slot->mi;
+		reset_and_release(slot);
+		return;
+	}
+	// Reservations finding no free VM will be handed this one as soon
+	// as its reset completes, instead of waiting for another VM.
+	slot->reset_deferred = true;
+	slot->prog_ref->m_vms_resetting.fetch_add(1, std::memory_order_relaxed);
+	if (slot->handoff_active) {
+		// Defer reset by posting it to the handoff loop
+		slot->handoff.post(
+		[] (void* slotv) -> long {
+			return reset_and_release((VMPoolItem *)slotv);
+		}, slot);
+	} else {
+		// Defer reset by executing it as a thread task
+		slot->task_future = slot->tp.enqueue(
+		[slot]() -> long {
+			return reset_and_release(slot);
+		});
+	}
+}
+/* Publish the latency percentiles of all programs, at most once per
+   interval, from whichever thread first notices that it is time. */
+static void publish_latencies(uint64_t now)
+{
+	static std::atomic<uint64_t> last_publish {0};
+	uint64_t last = last_publish.load(std::memory_order_relaxed);
+	if (now - last < LATENCY_VSC_INTERVAL_NS
+		|| !last_publish.compare_exchange_strong(last, now))
+		return;
+
+	const auto resv = g_reservation_wait.snapshot();
+	const auto req  = g_request_latency.snapshot();
+	const uint64_t resv_us[4] = {
+		resv.percentile(0.5) / 1000, resv.percentile(0.9) / 1000,
+		resv.percentile(0.99) / 1000, resv.percentile(0.999) / 1000 };
+	const uint64_t req_us[4] = {
+		req.percentile(0.5) / 1000, req.percentile(0.9) / 1000,
+		req.percentile(0.99) / 1000, req.percentile(0.999) / 1000 };
+	kvm_varnishstat_latency(resv_us, req_us);
+}
+long ProgramInstance::reset_and_release(VMPoolItem* slot)
+{
+	auto& mi = *slot->mi;
+	auto* prog = slot->prog_ref.get();
+	const bool reset_needed = mi.is_reset_needed();
+	const bool workmem_sample = prog->m_workmem.adaptive && reset_needed;
+	const uint64_t banked = workmem_sample ? mi.machine().banked_memory_bytes() : 0;
+	const uint64_t full_resets = mi.stats().full_resets;
+	const uint64_t reset_t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	{
+		ScopedAllocations allocs(mi.request_allocations());
 
 		// Free regexes, file descriptors etc.
 		mi.tail_reset();
 
 		// Reset to the current program (even though it might die before next req).
 		mi.reset_to(nullptr, *mi.program().main_vm);
+	}
+	const uint64_t reset_ns = ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - reset_t0;
+	prog->latency.reset.record(reset_ns);
+	const bool full_reset = mi.stats().full_resets != full_resets;
+	if (reset_needed) {
+		// Incremental resets only restore the pages dirtied by the request
+		if (full_reset)
+			prog->latency.reset_full.record(reset_ns);
+		else
+			prog->latency.reset_incremental.record(reset_ns);
+	}
+	if (workmem_sample) {
+		prog->workmem_sample(banked, slot->retained_workmem, reset_ns, full_reset);
+		slot->retained_workmem = mi.machine().banked_memory_bytes();
+	}
+	// The reset is the last part of a request
+	mi.stats().request_allocations = mi.request_allocations();
+	mi.stats().heap_allocations += mi.request_allocations();
+	mi.request_allocations() = 0;
+
+	auto ref = std::move(slot->prog_ref);
+	const uint64_t now = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	slot->last_released.store(now, std::memory_order_relaxed);
+	const uint64_t service_ns = now - slot->reserved_at;
+	ref->latency.request.record(service_ns);
+	if (!slot->served) {
+		slot->served = true;
+		ref->latency.first_request.record(service_ns);
+	}
+	g_request_latency.record(service_ns);
+	{
+		/* Moving average with alpha = 1/8. Racy, but lost samples are fine. */
+		const uint64_t ewma = ref->m_service_ewma.load(std::memory_order_relaxed);
+		ref->m_service_ewma.store(ewma - ewma / 8 + service_ns / 8, std::memory_order_relaxed);
+	}
+	ref->latency.reset_completion.record(now - slot->reset_queued_at);
+	if (slot->reset_deferred) {
+		slot->reset_deferred = false;
+		ref->m_vms_resetting.fetch_sub(1, std::memory_order_relaxed);
+	}
+	ref->m_vms_in_use.fetch_sub(1, std::memory_order_relaxed);
+	kvm_varnishstat_vms_in_use(-1);
+	publish_latencies(now);
+	// A waiting reservation gets this VM straight out of its reset
+	if (ref->m_lane_waiters.load(std::memory_order_relaxed) > 0)
+		__sync_fetch_and_add(&ref->stats.reset_handoffs, 1);
+	// Signal waiters that slot is ready again
+	// If there any waiters, they keep the program referenced (atomically)
+	ref->release_vm(slot);
+	// Record the pages touched since a cold start restore, on the
+	// timer thread of the program instead of the request path
+	auto& cold_start = ref->m_cold_start;
+	if (cold_start.record_countdown.load(std::memory_order_relaxed) > 0
+		&& cold_start.record_countdown.fetch_sub(1) == 1)
+	{
+		ref->m_timer_system.add(std::chrono::milliseconds(0),
+		[prog = ref.get()] (auto) {
+			prog->m_cold_start.record_hot_set(prog->m_snapshot_file);
+		});
+	}
+	return 0;
+}
 
-		auto ref = std::move(slot->prog_ref);
-		// Signal waiters that slot is ready again
-		// If there any waiters, they keep the program referenced (atomically)
-		ref->m_vmqueue[numa_node()].enqueue(slot);
-	} else {
-		// Defer reset by executing it as a thread task
-		slot->task_future = slot->tp.enqueue(
-		[slot]() -> long {
-			auto& mi = *slot->mi;
+void ProgramInstance::workmem_sample(uint64_t banked, uint64_t retained,
+	uint64_t reset_ns, bool full_reset)
+{
+	/* Racy updates from concurrent resets, but lost samples are fine. */
+	auto& wm = this->m_workmem;
+	const auto ewma = [] (std::atomic<uint64_t>& avg, uint64_t sample) {
+		const uint64_t value = avg.load(std::memory_order_relaxed);
+		avg.store(value - value / 8 + sample / 8, std::memory_order_relaxed);
+	};
+	ewma(wm.banked_avg, banked);
+	// Memory that had to be banked (and faulted in) again, because
+	// the previous reset gave it back
+	ewma(wm.refaulted_avg, banked > retained ? banked - retained : 0);
+	ewma(wm.reset_avg, reset_ns);
+	if (full_reset)
+		wm.full_resets.fetch_add(1, std::memory_order_relaxed);
+
+	// Rise to every new peak, and decay slowly afterwards
+	uint64_t peak = wm.peak.load(std::memory_order_relaxed);
+	peak = std::max(banked, peak - peak / WORKMEM_PEAK_DECAY);
+	wm.peak.store(peak, std::memory_order_relaxed);
+
+	// Keep whole memory banks, but never more than the configured limit
+	const uint64_t banks = (peak + WORKMEM_BANK_SIZE - 1) / WORKMEM_BANK_SIZE;
+	const uint64_t limit = std::max(banks, uint64_t(1)) * WORKMEM_BANK_SIZE;
+	wm.limit.store(std::min(limit, wm.cap.load(std::memory_order_relaxed)),
+		std::memory_order_relaxed);
+}
 
-			// Free regexes, file descriptors etc.
-			mi.tail_reset();
+VMPoolItem* ProgramInstance::try_dequeue_vm(unsigned node)
+{
+	VMPoolItem* slot = nullptr;
+	if (m_vmqueue[node].try_dequeue(slot))
+		return slot;
+	// Steal from remote nodes before starting to wait
+	for (unsigned i = 1; i < m_num_nodes; i++) {
+		if (m_vmqueue[(node + i) % m_num_nodes].try_dequeue(slot)) {
+			__sync_fetch_and_add(&this->stats.numa_steals, 1);
+			return slot;
+		}
+	}
+	return nullptr;
+}
 
-			// Reset to the current program (even though it might die before next req).
-			mi.reset_to(nullptr, *mi.program().main_vm);
+void ProgramInstance::admission_control(const TenantInstance* ten)
+{
+	const auto& group = ten->config.group;
+	if (LIKELY(group.max_queue_wait_ms == 0 && group.max_queue_waiters == 0))
+		return;
+	// A scaled-to-zero pool is woken up instead
+	if (this->m_pool_size.load() == 0)
+		return;
+
+	const uint64_t waiters = this->queue_depth();
+	// VMs being reset are handed to the first waiters as soon as their
+	// reset completes, so those waiters are never queued for long.
+	if (waiters < uint64_t(this->vms_resetting()))
+		return;
+	// Every VM in the pool works through the queue ahead of us
+	const uint64_t vms = std::max(this->m_pool_size.load(), size_t(1));
+	const uint64_t estimate = (waiters + 1) * service_time_ewma() / vms;
+
+	const bool too_many = group.max_queue_waiters > 0
+		&& waiters >= group.max_queue_waiters;
+	const bool too_long = group.max_queue_wait_ms > 0
+		&& estimate > uint64_t(group.max_queue_wait_ms) * 1'000'000ull;
+	if (LIKELY(!too_many && !too_long))
+		return;
+
+	__sync_fetch_and_add(&this->stats.requests_shed, 1);
+	kvm_varnishstat_requests_shed();
+	// Suggest retrying once the current queue has drained
+	const uint32_t retry_after =
+		std::max((estimate + 999'999'999ull) / 1'000'000'000ull, uint64_t(1));
+	throw AdmissionRejected(group.shed_status, retry_after);
+}
 
-			auto ref = std::move(slot->prog_ref);
-			// Signal waiters that slot is ready again
-			// If there any waiters, they keep the program referenced (atomically)
-			ref->m_vmqueue[numa_node()].enqueue(slot);
-			return 0;
-		});
+VMPoolItem* ProgramInstance::take_free_vm(unsigned node)
+{
+	if (this->m_lifo_handoff) {
+		for (unsigned i = 0; i < m_num_nodes; i++) {
+			auto& hot = m_hot_vm[(node + i) % m_num_nodes];
+			if (hot.vm.load(std::memory_order_relaxed) == nullptr)
+				continue;
+			if (VMPoolItem* slot = hot.vm.exchange(nullptr))
+				return slot;
+		}
+	}
+	return try_dequeue_vm(node);
+}
+
+VMPoolItem* ProgramInstance::wait_for_vm(const TenantInstance* ten,
+	unsigned node, unsigned priority, std::chrono::microseconds tmo)
+{
+	VMWaiter waiter {node};
+	{
+		std::scoped_lock lock(m_lanes_mtx);
+		// Announce that we are waiting, so that releases go to
+		// the queue, then check for free VMs again (see enqueue_vm).
+		// Even when there is one, the lanes decide who gets it.
+		m_lane_waiters.fetch_add(1);
+		kvm_varnishstat_queue_depth(1);
+		auto& lane = m_lanes[priority];
+		if (lane.tail != nullptr)
+			lane.tail->next = &waiter;
+		else
+			lane.head = &waiter;
+		lane.tail = &waiter;
+		this->dispatch_locked();
+	}
+	// A scaled-to-zero pool has no VMs to release (see retire_free_vms),
+	// and if none can be forked there is no point in waiting.
+	if (UNLIKELY(m_pool_size.load() == 0) && !this->pool_wake(ten))
+		tmo = std::chrono::microseconds(0);
+	if (waiter.sema.wait(tmo.count()))
+		return waiter.slot;
+
+	std::scoped_lock lock(m_lanes_mtx);
+	if (waiter.slot != nullptr) {
+		// Handed a VM right as we timed out, consume the signal
+		waiter.sema.wait();
+		return waiter.slot;
+	}
+	// Unlink ourselves from the lane
+	auto& lane = m_lanes[priority];
+	VMWaiter* prev = nullptr;
+	for (VMWaiter* w = lane.head; w != &waiter; prev = w, w = w->next);
+	if (prev != nullptr)
+		prev->next = waiter.next;
+	else
+		lane.head = waiter.next;
+	if (lane.tail == &waiter)
+		lane.tail = prev;
+	m_lane_waiters.fetch_sub(1);
+	kvm_varnishstat_queue_depth(-1);
+	return nullptr;
+}
+
+void ProgramInstance::enqueue_vm(VMPoolItem* slot)
+{
+	slot->in_pool.store(true, std::memory_order_relaxed);
+	m_vmqueue[slot->node].enqueue(slot);
+	// Pairs with the waiter announcement in wait_for_vm
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_lane_waiters.load() > 0)
+		this->dispatch_waiters();
+}
+
+void ProgramInstance::dispatch_waiters()
+{
+	std::scoped_lock lock(m_lanes_mtx);
+	this->dispatch_locked();
+}
+
+void ProgramInstance::dispatch_locked()
+{
+	while (m_lane_waiters.load(std::memory_order_relaxed) > 0)
+	{
+		// Smooth weighted round-robin between the non-empty lanes
+		int total = 0;
+		Lane* best = nullptr;
+		for (unsigned prio = 0; prio < NUM_PRIORITIES; prio++) {
+			auto& lane = m_lanes[prio];
+			if (lane.head == nullptr) {
+				lane.credit = 0;
+				continue;
+			}
+			lane.credit += PRIORITY_WEIGHTS[prio];
+			total += PRIORITY_WEIGHTS[prio];
+			if (best == nullptr || lane.credit > best->credit)
+				best = &lane;
+		}
+		VMWaiter* waiter = best->head;
+		VMPoolItem* slot = take_free_vm(waiter->node);
+		if (slot == nullptr) {
+			// Nothing to hand out, so the selection does not count
+			for (unsigned prio = 0; prio < NUM_PRIORITIES; prio++) {
+				if (m_lanes[prio].head != nullptr)
+					m_lanes[prio].credit -= PRIORITY_WEIGHTS[prio];
+			}
+			return;
+		}
+		best->credit -= total;
+		best->head = waiter->next;
+		if (best->head == nullptr)
+			best->tail = nullptr;
+		m_lane_waiters.fetch_sub(1);
+		kvm_varnishstat_queue_depth(-1);
+		waiter->slot = slot;
+		waiter->sema.signal();
+	}
+}
+
+void ProgramInstance::release_vm(VMPoolItem* slot)
+{
+	// VMs go back to the node their memory was allocated on
+	const unsigned node = slot->node;
+	if (this->m_lifo_handoff) {
+		auto& hot = m_hot_vm[node];
+		// Waiting reservations are served from the queue
+		if (m_lane_waiters.load() == 0) {
+			// Swap in the new hot VM and queue the previous one
+			slot->in_pool.store(true, std::memory_order_relaxed);
+			slot = hot.vm.exchange(slot);
+			// A reservation may have started waiting after we checked,
+			// without seeing the new hot VM. Give it to the queue instead.
+			if (slot == nullptr && UNLIKELY(m_lane_waiters.load() > 0))
+				slot = hot.vm.exchange(nullptr);
+			if (slot == nullptr)
+				return;
+		}
+	}
+	this->enqueue_vm(slot);
+}
+
+void ProgramInstance::pool_autoscale(const TenantInstance* ten)
+{
+	const auto& group = ten->config.group;
+	const uint64_t now = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	const uint64_t threshold = uint64_t(group.scale_up_wait_ms) * 1'000'000ull;
+	const uint64_t ewma = m_resv_wait_ewma.load(std::memory_order_relaxed);
+	// Decay the average, so that it drops when nobody is waiting
+	m_resv_wait_ewma.store(ewma / 2, std::memory_order_relaxed);
+
+	if (ewma > threshold) {
+		if (this->m_pool_size < group.max_concurrency && this->pool_grow(ten)) {
+			__sync_fetch_and_add(&this->stats.pool_scale_ups, 1);
+		}
+	} else if (ewma < threshold / 2 && this->m_pool_size > group.min_concurrency
+		&& this->m_pool_size - this->vms_in_use() > group.standby_vms) {
+		const uint64_t idle_ns = uint64_t(group.scale_down_idle_ms) * 1'000'000ull;
+		if (this->pool_retire_idle(now, idle_ns)) {
+			__sync_fetch_and_add(&this->stats.pool_scale_downs, 1);
+		}
+	}
+}
+
+void ProgramInstance::pool_standby(const TenantInstance* ten)
+{
+	const auto& group = ten->config.group;
+	// A scaled-to-zero or evicted pool stays empty until woken up
+	while (this->m_pool_size.load() > 0
+		&& this->m_pool_size.load() < group.max_concurrency)
+	{
+		const size_t in_use = std::min(size_t(this->vms_in_use()), this->m_pool_size.load());
+		if (this->m_pool_size.load() - in_use >= group.standby_vms)
+			return;
+		if (!this->pool_grow(ten))
+			return;
+		__sync_fetch_and_add(&this->stats.standby_forks, 1);
+	}
+}
+
+void ProgramInstance::pool_scale_to_zero(const TenantInstance* ten)
+{
+	const auto& group = ten->config.group;
+	if (this->m_pool_size.load() == 0)
+		return;
+	const uint64_t now = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	const uint64_t last_reserved = this->last_reserved();
+
+	const uint64_t idle_ns = uint64_t(group.scale_to_zero_ms) * 1'000'000ull;
+	if (group.scale_to_zero_ms != 0 && this->is_idle() && last_reserved + idle_ns <= now) {
+		if (this->retire_free_vms(ten) > 0 && this->m_pool_size.load() == 0)
+			this->stats.scale_to_zero ++;
+		return;
+	}
+	// Grow a woken pool back to its initial size, one VM at a time
+	const uint64_t active_ns = uint64_t(POOL_GROW_BACK_ACTIVE_MS) * 1'000'000ull;
+	if (this->stats.cold_restores > 0 && last_reserved + active_ns > now
+		&& this->m_pool_size < group.initial_concurrency())
+		this->pool_grow(ten);
+}
+
+size_t ProgramInstance::retire_free_vms(const TenantInstance* ten, bool wake)
+{
+	size_t retired = 0;
+	while (VMPoolItem* slot = this->take_free_vm(0))
+	{
+		slot->in_pool.store(false, std::memory_order_relaxed);
+		if (!wake) {
+			// Without waking the pool, the VM of a waiting reservation
+			// is never retired. Waiters announce themselves under the
+			// lanes lock, and then see the pool size (see wait_for_vm).
+			std::unique_lock lanes(m_lanes_mtx);
+			if (m_lane_waiters.load() > 0) {
+				lanes.unlock();
+				this->enqueue_vm(slot);
+				break;
+			}
+			this->m_pool_size --;
+		}
+		const uint64_t memory = slot->mi->machine().banked_memory_bytes();
+		slot->retire(m_vms_mtx);
+		if (wake)
+			this->m_pool_size --;
+		__sync_fetch_and_add(&this->stats.memory_reclaimed, memory);
+		this->budget_release(m_vm_budget, 1);
+		retired ++;
+		// A reservation started waiting, which wakes the pool if we
+		// took the last VM (see wait_for_vm).
+		if (UNLIKELY(m_lane_waiters.load() > 0))
+			break;
+	}
+	if (wake && this->m_pool_size.load() == 0 && UNLIKELY(m_lane_waiters.load() > 0))
+		this->pool_wake(ten);
+	return retired;
+}
+
+size_t ProgramInstance::pool_evict()
+{
+	// Evictions happen while committing to the budget, which waking
+	// the pool would do again.
+	const size_t retired = this->retire_free_vms(m_pool_tenant, false);
+	if (retired > 0)
+		__sync_fetch_and_add(&this->stats.budget_evictions, 1);
+	return retired;
+}
+
+bool ProgramInstance::pool_wake(const TenantInstance* ten)
+{
+	std::scoped_lock lock(m_wake_mtx);
+	// Only the first waiter forks, the rest are woken by its VM
+	if (this->m_pool_size.load() > 0)
+		return true;
+	ScopedLatency restore_latency(this->latency.cold_restore);
+	if (!this->pool_grow(ten))
+		return false;
+	__sync_fetch_and_add(&this->stats.cold_restores, 1);
+	return true;
+}
+
+bool ProgramInstance::budget_commit(uint64_t memory, uint64_t vms)
+{
+	if (!Budget::get().commit(this, memory, vms))
+		return false;
+	this->m_budget_memory += memory;
+	this->m_budget_vms += vms;
+	return true;
+}
+
+void ProgramInstance::budget_release(uint64_t memory, uint64_t vms) noexcept
+{
+	this->m_budget_memory -= memory;
+	this->m_budget_vms -= vms;
+	Budget::get().release(memory, vms);
+}
+
+bool ProgramInstance::pool_grow(const TenantInstance* ten)
+{
+	// May retire VMs from other, idle programs to make room
+	if (!this->budget_commit(m_vm_budget, 1))
+		return false;
+	VMPoolItem* slot = nullptr;
+	try {
+		std::scoped_lock lock(m_vms_mtx);
+		// Prefer re-forking a retired VM, keeping its thread
+		for (auto& vm : m_vms) {
+			if (vm.is_retired()) {
+				slot = &vm;
+				slot->task_future = slot->fork(*main_vm, ten, this);
+				break;
+			}
+		}
+		if (slot == nullptr) {
+			if (m_vms.size() >= ten->config.group.max_concurrency) {
+				this->budget_release(m_vm_budget, 1);
+				return false;
+			}
+			const unsigned reqid = m_vms.size();
+			slot = &m_vms.emplace_back(reqid, reqid % m_num_nodes, *main_vm, ten, this);
+		}
+		slot->task_future.get();
+		this->m_pool_size ++;
+	} catch (const std::exception& e) {
+		VSL(SLT_Error, 0,
+			"kvm: Program '%s' failed to grow request VM pool: %s",
+			ten->config.name.c_str(), e.what());
+		this->budget_release(m_vm_budget, 1);
+		return false;
+	}
+	slot->last_released.store(ScopedDuration<CLOCK_MONOTONIC>::nanos_now(),
+		std::memory_order_relaxed);
+	this->enqueue_vm(slot);
+	return true;
+}
+
+bool ProgramInstance::pool_retire_idle(uint64_t now, uint64_t idle_ns)
+{
+	// Queues are only ordered per producer, and recently released VMs
+	// may be in the hot slots, so look for the oldest free VM instead.
+	VMPoolItem* oldest = nullptr;
+	{
+		std::scoped_lock lock(m_vms_mtx);
+		for (auto& vm : m_vms) {
+			if (vm.is_retired() || !vm.in_pool.load(std::memory_order_relaxed))
+				continue;
+			const uint64_t released = vm.last_released.load(std::memory_order_relaxed);
+			if (released + idle_ns > now)
+				continue;
+			if (oldest == nullptr
+				|| released < oldest->last_released.load(std::memory_order_relaxed))
+				oldest = &vm;
+		}
+	}
+	if (oldest == nullptr)
+		return false;
+
+	// Take it out of its hot slot, or else take the first VM in the
+	// queue of its node, which is usually the oldest. Searching the
+	// queue would leave concurrent reservations with an empty queue.
+	VMPoolItem* slot = oldest;
+	if (!m_hot_vm[oldest->node].vm.compare_exchange_strong(slot, nullptr)) {
+		slot = nullptr;
+		// Reserved in the meantime
+		if (!m_vmqueue[oldest->node].try_dequeue(slot))
+			return false;
+		if (slot->last_released.load(std::memory_order_relaxed) + idle_ns > now) {
+			this->enqueue_vm(slot);
+			return false;
+		}
+	}
+	slot->in_pool.store(false, std::memory_order_relaxed);
+	slot->retire(m_vms_mtx);
+	this->m_pool_size --;
+	this->budget_release(m_vm_budget, 1);
+	return true;
+}
+
+/* Held along with the storage gate, exclusively, around everything that
+   runs in the storage VM. Views of storage see what storage writes to
+   memory that is already mapped, so they only need to be forked again
+   when storage maps new memory: when the top of its mmap area moves,
+   or when it allocates new pages. */
+struct StorageWrite {
+	StorageWrite(Storage& st) : m_st(st), m_layout(layout(st)) {}
+	~StorageWrite() {
+		if (layout(m_st) != m_layout)
+			m_st.write_epoch ++;
+	}
+private:
+	static std::pair<uint64_t, uint64_t> layout(Storage& st) {
+		auto& stm = st.storage_vm->machine();
+		return {stm.mmap(), stm.banked_memory_bytes()};
+	}
+	Storage& m_st;
+	const std::pair<uint64_t, uint64_t> m_layout;
+};
+
+/* Copy the buffers onto the stack of storage below vaddr, and the
+   buffer vector below them. Buffers in the storage mailbox are already
+   in storage, and are passed by reference. Returns the vector address. */
+static uint64_t storage_copy_inputs(MachineInstance& storage_vm, tinykvm::Machine& src,
+	uint64_t vaddr, size_t n, VirtBuffer buffers[], StorageMailbox* mailbox)
+{
+	auto& stm = storage_vm.machine();
+	for (size_t i = 0; i < n; i++) {
+		storage_vm.stats().input_bytes += buffers[i].len;
+		if (mailbox != nullptr && mailbox->contains(buffers[i].addr, buffers[i].len)) {
+			mailbox->stats.passed += buffers[i].len;
+			continue;
+		}
+		vaddr -= buffers[i].len;
+		vaddr &= ~(uint64_t)0x7;
+		stm.copy_from_machine(vaddr, src, buffers[i].addr, buffers[i].len);
+		buffers[i].addr = vaddr;
+	}
+	vaddr -= n * sizeof(VirtBuffer);
+	stm.copy_to_guest(vaddr, buffers, n * sizeof(VirtBuffer));
+	return vaddr;
+}
+
+/* Only the storage VM itself can write results into the mailbox, as
+   views of storage write to their own copies of its pages. */
+static bool storage_result_in_place(MachineInstance& storage_vm,
+	const StorageMailbox* mailbox, uint64_t res_addr, size_t res_size)
+{
+	return mailbox != nullptr && res_addr != 0 && mailbox->contains(res_addr, res_size)
+		&& storage_vm.program().storage().storage_vm.get() == &storage_vm;
+}
+
+/* Copy the buffers into the given storage VM (or a view of it), call
+   the storage function and copy its result back into the caller. With
+   a mailbox, its buffers are passed by reference, and a destination in
+   the mailbox is passed to the storage function, which can write its
+   result there directly. */
+static long storage_vmcall(MachineInstance& storage_vm, tinykvm::Machine& src,
+	uint64_t func, size_t n, VirtBuffer buffers[], uint64_t res_addr, size_t res_size,
+	StorageMailbox* mailbox = nullptr)
+{
+	auto& stm = storage_vm.machine();
+	if (mailbox != nullptr && !mailbox->enabled())
+		mailbox = nullptr;
+	const uint64_t stm_bufaddr = storage_copy_inputs(storage_vm, src,
+		stm.stack_address(), n, buffers, mailbox);
+	const uint64_t new_stack = stm_bufaddr & ~0xFL;
+	const bool in_place = storage_result_in_place(storage_vm, mailbox, res_addr, res_size);
+
+	try {
+		if constexpr (VERBOSE_STORAGE_TASK) {
+			printf("Storage task calling 0x%lX with stack 0x%lX\n",
+				func, new_stack);
+		}
+		const float timeout = storage_vm.tenant().config.max_storage_time();
+		storage_vm.begin_call();
+		storage_vm.stats().invocations++;
+		ScopedDuration cputime(storage_vm.stats().request_cpu_time);
+
+		/* Build call manually. */
+		tinykvm::tinykvm_x86regs regs;
+		stm.setup_call(regs, func, new_stack,
+			(uint64_t)n, (uint64_t)stm_bufaddr, (uint64_t)res_size,
+			in_place ? res_addr : 0x0);
+		stm.set_registers(regs);
+
+		/* Check if this is a debug program. */
+		if (storage_vm.is_debug()) {
+			storage_vm.storage_debugger(timeout);
+		} else {
+			stm.run(timeout);
+		}
+
+		const bool storage_resume   = storage_vm.response_called(2);
+		const bool storage_noreturn = storage_vm.response_called(3);
+
+		/* The machine must be stopped, and it must have called storage_[no]return. */
+		if (!stm.stopped() || !(storage_resume || storage_noreturn)) {
+			throw std::runtime_error("Storage did not respond properly");
+		}
+
+		/* Get the result buffer and length (capped to res_size) */
+		regs = stm.registers();
+		const uint64_t st_res_buffer = regs.rdi;
+		const uint64_t st_res_size  = (regs.rsi < res_size) ? regs.rsi : res_size;
+		if (in_place && st_res_buffer == res_addr) {
+			/* The result was written directly into the mailbox */
+			mailbox->stats.in_place += st_res_size;
+		} else if (res_addr != 0x0 && st_res_buffer != 0x0) {
+			/* Copy from the storage machine back into tenant VM instance */
+			src.copy_from_machine(res_addr, stm, st_res_buffer, st_res_size);
+			storage_vm.stats().output_bytes += st_res_size;
+		}
+
+		/* If res_addr is zero, we will just return the
+		   length provided by storage as-is, to allow some
+		   communication without a buffer. */
+		const auto retval = (res_addr != 0) ? st_res_size : regs.rsi;
+
+		if (storage_resume)
+		{
+			/* Resume, run the function to the end, allowing cleanup */
+			stm.run(STORAGE_CLEANUP_TIMEOUT);
+		}
+
+		if constexpr (VERBOSE_STORAGE_TASK) {
+			printf("<- Storage task on main queue returning %llu to 0x%lX\n",
+				retval, st_res_buffer);
+		}
+		return retval;
+
+	} catch (const std::exception& e) {
+		if constexpr (VERBOSE_STORAGE_TASK) {
+			printf("<- Storage task on main queue failed: %s\n",
+				e.what());
+		}
+		storage_vm.stats().exceptions++;
+		return -1;
+	}
+}
+
+/* Run a batch of storage calls with one call into the batch entry point
+   of the storage program, which calls each storage function in turn.
+   Each function still responds with storage_return(), and its result is
+   copied back to its caller before storage is resumed. A call that fails
+   or does not return restarts the entry point at the call after it.
+   A call whose inputs cannot be copied into storage fails on its own,
+   with the error stored for its caller, and is left out of the batch. */
+static void storage_vmcall_batch(MachineInstance& storage_vm, uint64_t entry,
+	const std::vector<Storage::BatchedCall*>& batch, StorageMailbox* mailbox)
+{
+	/* Layout of struct storage_batch_call in the storage program */
+	struct BatchDescriptor {
+		uint64_t func;
+		uint64_t n;
+		uint64_t buffers;
+		uint64_t res;
+		uint64_t dst;
+	};
+	auto& stm = storage_vm.machine();
+	std::vector<Storage::BatchedCall*> calls;
+	std::vector<BatchDescriptor> descriptors;
+	std::vector<bool> in_place;
+	calls.reserve(batch.size());
+	descriptors.reserve(batch.size());
+	in_place.reserve(batch.size());
+	uint64_t vaddr = stm.stack_address();
+
+	if (mailbox != nullptr && !mailbox->enabled())
+		mailbox = nullptr;
+
+	for (auto* callp : batch) {
+		auto& call = *callp;
+		call.result = -1;
+		try {
+			vaddr = storage_copy_inputs(storage_vm, *call.src, vaddr, call.n, call.buffers, mailbox);
+		} catch (...) {
+			storage_vm.stats().exceptions++;
+			call.error = std::current_exception();
+			continue;
+		}
+		const bool result_in_place =
+			storage_result_in_place(storage_vm, mailbox, call.res_addr, call.res_size);
+		calls.push_back(callp);
+		in_place.push_back(result_in_place);
+		descriptors.push_back({call.func, call.n, vaddr, call.res_size,
+			result_in_place ? call.res_addr : 0x0});
+	}
+	const size_t count = calls.size();
+	if (count == 0)
+		return;
+	vaddr -= count * sizeof(BatchDescriptor);
+	const uint64_t descriptors_addr = vaddr;
+	stm.copy_to_guest(descriptors_addr, descriptors.data(), count * sizeof(BatchDescriptor));
+	/* The entry point stores the index of the call it is running here */
+	vaddr -= sizeof(uint64_t);
+	const uint64_t current_addr = vaddr;
+	const uint64_t new_stack = vaddr & ~0xFL;
+
+	const float timeout = storage_vm.tenant().config.max_storage_time();
+	storage_vm.stats().invocations += count;
+	ScopedDuration cputime(storage_vm.stats().request_cpu_time);
+
+	size_t next = 0; /* The first call without a result */
+	while (next < count) {
+		const size_t base = next;
+		const uint64_t zero = 0;
+		stm.copy_to_guest(current_addr, &zero, sizeof(zero));
+		tinykvm::tinykvm_x86regs regs;
+		stm.setup_call(regs, entry, new_stack, uint64_t(count - base),
+			descriptors_addr + base * sizeof(BatchDescriptor), current_addr);
+		stm.set_registers(regs);
+
+		bool restart = false;
+		while (!restart && next < count) {
+			storage_vm.begin_call();
+			bool failed = false;
+			try {
+				stm.run(timeout);
+			} catch (const std::exception& e) {
+				if constexpr (VERBOSE_STORAGE_TASK) {
+					printf("<- Storage batch failed: %s\n", e.what());
+				}
+				failed = true;
+			}
+			const bool storage_resume   = !failed && storage_vm.response_called(2);
+			const bool storage_noreturn = !failed && storage_vm.response_called(3);
+			uint64_t current = 0;
+			stm.copy_from_guest(&current, current_addr, sizeof(current));
+			size_t index = base + current;
+			if (!failed && !storage_resume && !storage_noreturn) {
+				/* The entry point returned, or stopped for another reason */
+				index = count;
+			} else if (index < next && failed) {
+				/* Failed while finishing a call that already responded */
+				storage_vm.stats().exceptions++;
+				restart = true;
+				continue;
+			} else if (index < next || index >= count) {
+				throw std::runtime_error("Storage batch entry point is corrupted");
+			}
+			/* Calls that were passed over did not respond */
+			for (; next < index; next++)
+				storage_vm.stats().exceptions++;
+			if (index == count)
+				break;
+			next = index + 1;
+			if (failed) {
+				storage_vm.stats().exceptions++;
+				restart = true;
+				continue;
+			}
+
+			auto& call = *calls[index];
+			regs = stm.registers();
+			const uint64_t st_res_buffer = regs.rdi;
+			const uint64_t st_res_size  = (regs.rsi < call.res_size) ? regs.rsi : call.res_size;
+			try {
+				if (in_place[index] && st_res_buffer == call.res_addr) {
+					mailbox->stats.in_place += st_res_size;
+				} else if (call.res_addr != 0x0 && st_res_buffer != 0x0) {
+					call.src->copy_from_machine(call.res_addr, stm, st_res_buffer, st_res_size);
+					storage_vm.stats().output_bytes += st_res_size;
+				}
+				call.result = (call.res_addr != 0) ? st_res_size : regs.rsi;
+			} catch (const std::exception& e) {
+				storage_vm.stats().exceptions++;
+			}
+			/* Without storage resuming, the entry point is gone */
+			if (storage_noreturn) {
+				restart = true;
+			} else if (next == count) {
+				/* Resume, run the last function to the end, allowing cleanup */
+				try {
+					stm.run(STORAGE_CLEANUP_TIMEOUT);
+				} catch (const std::exception& e) {
+					storage_vm.stats().exceptions++;
+				}
+			}
+		}
 	}
 }
 
@@ -573,104 +1756,187 @@ long ProgramInstance::storage_call(tinykvm::Machine& src, gaddr_t func,
 	/* Check allow-list for what storage functions are allowed. */
 	if (!storage().is_allowed(func))
 		throw std::runtime_error("Not allowed to call storage function");
+	/* Read-only functions run concurrently, when there are views. */
+	if (storage().is_readonly(func) && !storage().readers.empty())
+		return this->storage_read_call(src, func, n, buffers, res_addr, res_size);
+
+	/* Calls that find other calls waiting are run together. */
+	if (storage().batch_max > 1)
+		return this->storage_batch_call(src, func, n, buffers, res_addr, res_size);
 
 	if constexpr (VERBOSE_STORAGE_TASK) {
 		printf("Storage task on main queue\n");
 	}
+	auto& shard = storage().shards.front();
+	const uint64_t t0 = shard.enqueued();
 	auto future = m_storage_queue.enqueue(
 	[&] () -> long
 	{
 		if constexpr (VERBOSE_STORAGE_TASK) {
 			printf("-> Storage task on main queue ENTERED\n");
 		}
-		auto& storage_vm = *storage().storage_vm;
-		auto& stm = storage_vm.machine();
-		uint64_t vaddr = stm.stack_address();
-		size_t total_input = 0;
+		shard.dequeued(t0);
+		std::scoped_lock gate(storage().gate);
+		StorageWrite write(storage());
+		return storage_vmcall(*storage().storage_vm, src, func, n, buffers, res_addr, res_size,
+			&storage().mailbox);
+	});
+	const long result = future.get();
+	this->schedule_storage_snapshot();
+	return result;
+}
 
-		for (size_t i = 0; i < n; i++) {
-			total_input += buffers[i].len;
-			vaddr -= buffers[i].len;
-			vaddr &= ~(uint64_t)0x7;
-			stm.copy_from_machine(vaddr, src, buffers[i].addr, buffers[i].len);
-			buffers[i].addr = vaddr;
+long ProgramInstance::storage_batch_call(tinykvm::Machine& src, gaddr_t func,
+	size_t n, VirtBuffer buffers[], gaddr_t res_addr, size_t res_size)
+{
+	auto& st = storage();
+	Storage::BatchedCall call {&src, func, n, buffers, res_addr, res_size,
+		st.shards.front().enqueued()};
+	{
+		std::scoped_lock lock(st.batch_mtx);
+		st.batch_pending.push_back(&call);
+		if (!st.batch_scheduled) {
+			st.batch_scheduled = true;
+			m_storage_queue.enqueue([this] () -> long {
+				return this->storage_batch_run();
+			});
 		}
+	}
+	call.done.wait();
+	/* Failures propagate like they do from the storage queue */
+	if (call.error)
+		std::rethrow_exception(call.error);
+	this->schedule_storage_snapshot();
+	return call.result;
+}
 
-		vaddr -= n * sizeof(VirtBuffer);
-		const uint64_t stm_bufaddr = vaddr;
-		stm.copy_to_guest(stm_bufaddr, buffers, n * sizeof(VirtBuffer));
-
-		const uint64_t new_stack = vaddr & ~0xFL;
-		storage_vm.stats().input_bytes += total_input;
+long ProgramInstance::storage_batch_run()
+{
+	auto& st = storage();
+	std::vector<Storage::BatchedCall*> batch;
+	{
+		std::scoped_lock lock(st.batch_mtx);
+		const size_t count = std::min(st.batch_pending.size(), size_t(st.batch_max));
+		batch.assign(st.batch_pending.begin(), st.batch_pending.begin() + count);
+		st.batch_pending.erase(st.batch_pending.begin(), st.batch_pending.begin() + count);
+		// Calls beyond the batch size wait for the next batch, which
+		// is queued behind any other work for storage.
+		if (st.batch_pending.empty()) {
+			st.batch_scheduled = false;
+		} else {
+			m_storage_queue.enqueue([this] () -> long {
+				return this->storage_batch_run();
+			});
+		}
+	}
+	// The calls belong to their waiting callers once they are done,
+	// which they must be told even when running them fails.
+	struct SignalCalls {
+		const std::vector<Storage::BatchedCall*>& batch;
+		~SignalCalls() {
+			for (auto* call : batch)
+				call->done.signal();
+		}
+	} signal_calls {batch};
+	for (auto* call : batch)
+		st.shards.front().dequeued(call->t0);
 
-		try {
-			if constexpr (VERBOSE_STORAGE_TASK) {
-				printf("Storage task calling 0x%lX with stack 0x%lX\n",
-					func, new_stack);
-			}
-			const float timeout = storage_vm.tenant().config.max_storage_time();
-			storage_vm.begin_call();
-			storage_vm.stats().invocations++;
-			ScopedDuration cputime(storage_vm.stats().request_cpu_time);
-
-			/* Build call manually. */
-			tinykvm::tinykvm_x86regs regs;
-			stm.setup_call(regs, func, new_stack,
-				(uint64_t)n, (uint64_t)stm_bufaddr, (uint64_t)res_size);
-			stm.set_registers(regs);
-
-			/* Check if this is a debug program. */
-			if (storage_vm.is_debug()) {
-				storage_vm.storage_debugger(timeout);
-			} else {
-				stm.run(timeout);
+	{
+		std::scoped_lock gate(st.gate);
+		StorageWrite write(st);
+		if (batch.size() == 1) {
+			auto& call = *batch.front();
+			try {
+				call.result = storage_vmcall(*st.storage_vm, *call.src,
+					call.func, call.n, call.buffers, call.res_addr, call.res_size, &st.mailbox);
+			} catch (...) {
+				call.error = std::current_exception();
 			}
-
-			const bool storage_resume   = storage_vm.response_called(2);
-			const bool storage_noreturn = storage_vm.response_called(3);
-
-			/* The machine must be stopped, and it must have called storage_[no]return. */
-			if (!stm.stopped() || !(storage_resume || storage_noreturn)) {
-				throw std::runtime_error("Storage did not respond properly");
+		} else {
+			try {
+				storage_vmcall_batch(*st.storage_vm, st.batch_entry, batch, &st.mailbox);
+			} catch (const std::exception& e) {
+				VSL(SLT_Error, 0, "kvm: Storage batch failed: %s", e.what());
+				st.storage_vm->stats().exceptions++;
 			}
+			st.batches.batches ++;
+			st.batches.calls += batch.size();
+			unsigned max_size = st.batches.max_size.load(std::memory_order_relaxed);
+			while (batch.size() > max_size && !st.batches.max_size.compare_exchange_weak(max_size, batch.size()));
+		}
+	}
+	return 0;
+}
 
-			/* Get the result buffer and length (capped to res_size) */
-			regs = stm.registers();
-			const gaddr_t st_res_buffer = regs.rdi;
-			const uint64_t st_res_size  = (regs.rsi < res_size) ? regs.rsi : res_size;
-			if (res_addr != 0x0 && st_res_buffer != 0x0) {
-				/* Copy from the storage machine back into tenant VM instance */
-				src.copy_from_machine(res_addr, stm, st_res_buffer, st_res_size);
-				storage_vm.stats().output_bytes += st_res_size;
-			}
+long ProgramInstance::storage_call_key(tinykvm::Machine& src, uint64_t key,
+	gaddr_t func, size_t n, VirtBuffer buffers[], gaddr_t res_addr, size_t res_size)
+{
+	auto& shard = storage().shard_of(key);
+	/* The first shard is the storage VM, with snapshots and views. */
+	if (shard.queue == nullptr)
+		return this->storage_call(src, func, n, buffers, res_addr, res_size);
 
-			/* If res_addr is zero, we will just return the
-			   length provided by storage as-is, to allow some
-			   communication without a buffer. */
-			const auto retval = (res_addr != 0) ? st_res_size : regs.rsi;
+	/* Detect wrap-around */
+	if (UNLIKELY(res_addr + res_size < res_addr))
+		return -1;
+	/* Check allow-list for what storage functions are allowed. */
+	if (!storage().is_allowed(func))
+		throw std::runtime_error("Not allowed to call storage function");
 
-			if (storage_resume)
-			{
-				/* Resume, run the function to the end, allowing cleanup */
-				stm.run(STORAGE_CLEANUP_TIMEOUT);
-			}
+	const uint64_t t0 = shard.enqueued();
+	return shard.queue->enqueue(
+	[&] () -> long
+	{
+		shard.dequeued(t0);
+		return storage_vmcall(*shard.vm, src, func, n, buffers, res_addr, res_size);
+	}).get();
+}
 
-			if constexpr (VERBOSE_STORAGE_TASK) {
-				printf("<- Storage task on main queue returning %llu to 0x%lX\n",
-					retval, st_res_buffer);
+long ProgramInstance::storage_read_call(tinykvm::Machine& src, gaddr_t func,
+	size_t n, VirtBuffer buffers[], gaddr_t res_addr, size_t res_size)
+{
+	auto& st = storage();
+	// Wait for a view before taking the gate, so that waiting for one
+	// does not hold back writers.
+	StorageReader* reader = nullptr;
+	st.free_readers.wait_dequeue(reader);
+	std::shared_lock gate(st.gate);
+
+	const int active = ++st.reads.active;
+	int max_active = st.reads.max_active.load(std::memory_order_relaxed);
+	while (active > max_active && !st.reads.max_active.compare_exchange_weak(max_active, active));
+	st.reads.calls ++;
+
+	long result = -1;
+	try {
+		result = reader->tp.enqueue(
+		[&] () -> long
+		{
+			auto& storage_vm = *st.storage_vm;
+			// Storage may have mapped new memory since the view was
+			// forked, which the view can not see.
+			const uint64_t epoch = st.write_epoch.load();
+			if (reader->mi == nullptr || reader->epoch != epoch) {
+				reader->mi = nullptr;
+				reader->mi = std::make_unique<MachineInstance>(
+					reader->reqid, storage_vm, &storage_vm.tenant(), this);
+				reader->epoch = epoch;
+				st.reads.forks ++;
 			}
+			const long retval = storage_vmcall(*reader->mi, src, func, n, buffers, res_addr, res_size,
+				&st.mailbox);
+			// Discard everything the call wrote to
+			reader->mi->reset_needed_now();
+			reader->mi->reset_to(nullptr, storage_vm);
 			return retval;
-
-		} catch (const std::exception& e) {
-			if constexpr (VERBOSE_STORAGE_TASK) {
-				printf("<- Storage task on main queue failed: %s\n",
-					e.what());
-			}
-			storage_vm.stats().exceptions++;
-			return -1;
-		}
-	});
-	return future.get();
+		}).get();
+	} catch (const std::exception& e) {
+		VSL(SLT_Error, 0, "kvm: Read-only storage call failed: %s", e.what());
+		reader->epoch = ~0ull; /* Fork again */
+	}
+	st.reads.active --;
+	st.free_readers.enqueue(reader);
+	return result;
 }
 
 long ProgramInstance::storage_task(gaddr_t func, std::string argument)
@@ -679,53 +1945,233 @@ long ProgramInstance::storage_task(gaddr_t func, std::string argument)
 	if (!storage().is_allowed(func))
 		throw std::runtime_error("Not allowed to call storage function");
 
-	std::scoped_lock lock(storage().m_async_mtx);
-	// Avoid the last task in case it is still active
-	while (storage().m_async_tasks.size() > 1)
-		// TODO: Read the return value of the tasks to detect errors
-		// XXX: This can re-throw a forwarded exception. Handle it?
-		storage().m_async_tasks.pop_front();
-
-	// Block and finish previous async tasks
-	storage().m_async_tasks.push_back(
-		m_storage_queue.enqueue(
-	[=, this, data_arg = std::move(argument)] () -> long
+	auto& tasks = storage().tasks;
+	std::scoped_lock lock(tasks.mtx);
+	if (tasks.queue.size() >= tasks.max_queued) {
+		// Coalesce with the newest queued task calling the same function.
+		// It has not started yet, so it will run with the newest argument,
+		// and no older argument queued behind it can run after it.
+		if (tasks.coalesce) {
+			for (auto it = tasks.queue.rbegin(); it != tasks.queue.rend(); ++it) {
+				if (it->func == func) {
+					it->argument = std::move(argument);
+					tasks.coalesced ++;
+					return it->id;
+				}
+			}
+		}
+		tasks.dropped ++;
+		return -1;
+	}
+	const uint64_t id = tasks.next_id++;
+	tasks.queue.push_back({id, func, std::move(argument),
+		ScopedDuration<CLOCK_MONOTONIC>::nanos_now()});
+	tasks.queued ++;
+	tasks.tasks ++;
+
+	// Each queued task has one run on the storage queue
+	m_storage_queue.enqueue([this] () -> long {
+		return this->storage_task_run();
+	});
+	return id;
+}
+
+long ProgramInstance::storage_task_run()
+{
+	auto& tasks = storage().tasks;
+	Storage::Task task;
 	{
+		std::scoped_lock lock(tasks.mtx);
+		task = std::move(tasks.queue.front());
+		tasks.queue.pop_front();
+		tasks.queued --;
+		tasks.running ++;
+	}
+	const uint64_t t1 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	tasks.wait.record(t1 - task.t0);
+	if constexpr (VERBOSE_STORAGE_TASK) {
+		printf("-> Async task on main queue\n");
+	}
+	auto& storage_vm = *storage().storage_vm;
+	auto& stm = storage_vm.machine();
+
+	Storage::TaskResult result {task.id, 1, 0};
+	try {
 		if constexpr (VERBOSE_STORAGE_TASK) {
-			printf("-> Async task on main queue\n");
+			printf("Calling 0x%lX\n", task.func);
 		}
-		auto& storage_vm = *storage().storage_vm;
-		auto& stm = storage_vm.machine();
+		/* Avoid async storage while still initializing. */
+		this->try_wait_for_startup_and_initialization();
+		std::scoped_lock gate(storage().gate);
+		StorageWrite write(storage());
 
-		try {
-			if constexpr (VERBOSE_STORAGE_TASK) {
-				printf("Calling 0x%lX\n", func);
-			}
-			/* Avoid async storage while still initializing. */
-			this->try_wait_for_startup_and_initialization();
+		storage_vm.stats().invocations++;
+		storage_vm.stats().input_bytes += task.argument.size();
+		ScopedDuration cputime(storage_vm.stats().request_cpu_time);
 
-			storage_vm.stats().invocations++;
-			storage_vm.stats().input_bytes += data_arg.size();
-			ScopedDuration cputime(storage_vm.stats().request_cpu_time);
+		unsigned long long rsp = stm.stack_address();
+		auto data_addr = stm.stack_push(rsp, task.argument);
 
-			unsigned long long rsp = stm.stack_address();
-			auto data_addr = stm.stack_push(rsp, data_arg);
+		stm.timed_vmcall_stack(task.func, rsp, ASYNC_STORAGE_TIMEOUT,
+			uint64_t(data_addr), uint64_t(task.argument.size()));
+		result.result = stm.return_value();
+		if constexpr (VERBOSE_STORAGE_TASK) {
+			printf("<- Async task finished 0x%lX\n", task.func);
+		}
+		tasks.completed ++;
+	} catch (const std::exception& e) {
+		VSL(SLT_Error, 0, "kvm: Storage task 0x%lX failed: %s", task.func, e.what());
+		storage_vm.stats().exceptions++;
+		tasks.failed ++;
+		result.status = -1;
+		result.result = -1;
+	}
+	tasks.run.record(ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t1);
+	{
+		std::scoped_lock lock(tasks.mtx);
+		tasks.running --;
+		tasks.results.push_back(result);
+		if (tasks.results.size() > STORAGE_TASK_MAX_RESULTS)
+			tasks.results.pop_front();
+	}
+	this->schedule_storage_snapshot();
+	return result.result;
+}
 
-			stm.timed_vmcall_stack(func, rsp, ASYNC_STORAGE_TIMEOUT,
-				uint64_t(data_addr), uint64_t(data_arg.size()));
-			if constexpr (VERBOSE_STORAGE_TASK) {
-				printf("<- Async task finished 0x%lX\n", func);
-			}
+void ProgramInstance::start_storage_readers(unsigned count)
+{
+	auto& st = storage();
+	auto& storage_vm = *st.storage_vm;
+	std::vector<std::future<long>> futures;
+	for (unsigned i = 0; i < count; i++) {
+		auto& reader = st.readers.emplace_back(i);
+		futures.push_back(reader.tp.enqueue(
+		[&reader, &storage_vm, this] () -> long {
+			reader.mi = std::make_unique<MachineInstance>(
+				reader.reqid, storage_vm, &storage_vm.tenant(), this);
+			return 0;
+		}));
+	}
+	for (auto& future : futures)
+		future.get();
+	for (auto& reader : st.readers)
+		st.free_readers.enqueue(&reader);
+}
+
+void ProgramInstance::start_storage_mailbox(uint64_t size)
+{
+	auto& st = storage();
+	auto& stm = st.storage_vm->machine();
+	// Requests only see storage memory when storage has its own gigapage
+	if ((stm.start_address() >> 30U) == 0)
+		throw std::runtime_error("The storage mailbox requires a storage program at its own address");
+	// A storage VM restored from a snapshot already has its mailbox
+	if (st.mailbox.size() == size)
+		return;
+	const uint64_t base = stm.mmap_allocate(size);
+	// Fault in the whole mailbox, so that requests and views of storage
+	// all share the pages of the storage VM.
+	static const std::array<uint8_t, 65536> zeroes {};
+	for (uint64_t offset = 0; offset < size; offset += zeroes.size())
+		stm.copy_to_guest(base + offset, zeroes.data(), std::min(uint64_t(zeroes.size()), size - offset));
+	st.mailbox.init(base, size);
+}
 
+void ProgramInstance::start_storage_shards(const vrt_ctx* ctx, TenantInstance* ten, unsigned count)
+{
+	auto& st = storage();
+	// Each shard boots from the storage binary, and is then called on
+	// its own thread, just like it was created. The shards boot one at
+	// a time, as booting registers the allowed storage functions.
+	for (unsigned i = 1; i < count; i++) {
+		auto& shard = st.shards.emplace_back(i);
+		shard.queue = std::make_unique<tinykvm::ThreadTask<std::function<long()>>>
+			(STORAGE_VM_NICE, false);
+		shard.queue->enqueue(
+		[&shard, &st, ctx, ten, this] () -> long {
+			shard.vm = std::make_unique<MachineInstance>
+				(st.storage_binary, ctx, ten, this, true, false);
+			shard.vm->initialize();
+			shard.vm->set_ctx(nullptr);
 			return 0;
-		} catch (const std::exception& e) {
-			if constexpr (VERBOSE_STORAGE_TASK) {
-				printf("<- Async task failure: %s\n", e.what());
-			}
-			storage_vm.stats().exceptions++;
-			return -1;
-		}
-	}));
+		}).get();
+	}
+}
+
+void ProgramInstance::prepare_storage_snapshot(const std::string& path)
+{
+	// A snapshot can only be restored by the same storage program
+	auto& binary = storage().storage_binary;
+	char identity[64];
+	const int len = snprintf(identity, sizeof(identity), "%08x %zu\n",
+		crc32c_hw((const char *)binary.data(), binary.size()), binary.size());
+	const std::string identity_file = path + ".binary";
+	std::string stored;
+	if (FILE* f = fopen(identity_file.c_str(), "r")) {
+		char buffer[64];
+		if (fgets(buffer, sizeof(buffer), f) != nullptr)
+			stored = buffer;
+		fclose(f);
+	}
+
+	std::scoped_lock lock(g_storage_snapshot_mtx);
+	auto& owner = g_storage_snapshot_owners[path];
+	// A program that is already using the snapshot hands its state
+	// over through live update serialization instead.
+	if (owner != nullptr || stored != std::string(identity, len)) {
+		unlink(path.c_str());
+		file_writer(identity_file, std::vector<uint8_t>(identity, identity + len));
+	}
+	owner = this;
+	storage().snapshot_file = path;
+}
+
+void ProgramInstance::schedule_storage_snapshot()
+{
+	auto& snapshots = storage().snapshots;
+	if (storage().snapshot_file.empty() || storage().storage_vm == nullptr)
+		return;
+	snapshots.dirty = true;
+	const uint64_t interval = storage().storage_vm->tenant().config.group.storage_snapshot_interval_ms;
+	if (interval == 0)
+		return;
+	// Only one caller schedules the next snapshot
+	const uint64_t now = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	uint64_t due = snapshots.next_due.load(std::memory_order_relaxed);
+	if (now < due || !snapshots.next_due.compare_exchange_strong(due, now + interval * 1'000'000))
+		return;
+	m_storage_queue.enqueue([this] () -> long {
+		return this->storage_snapshot(false);
+	});
+}
+
+long ProgramInstance::storage_snapshot(bool force)
+{
+	/* Runs on the storage thread, so that no storage calls are in progress. */
+	auto& snapshots = storage().snapshots;
+	if (!force && !snapshots.dirty.exchange(false))
+		return 0;
+	{
+		std::scoped_lock lock(g_storage_snapshot_mtx);
+		auto it = g_storage_snapshot_owners.find(storage().snapshot_file);
+		if (it == g_storage_snapshot_owners.end() || it->second != this)
+			return 0; /* Taken over by a newer program */
+	}
+	auto& storage_vm = *storage().storage_vm;
+	const uint64_t t0 = ScopedDuration<CLOCK_MONOTONIC>::nanos_now();
+	try {
+		storage_vm.machine().save_snapshot_state_now();
+		storage().save_state(storage_vm.machine().get_snapshot_state_user_area());
+	} catch (const std::exception& e) {
+		VSL(SLT_Error, 0, "kvm: Storage snapshot of '%s' failed: %s",
+			storage_vm.name().c_str(), e.what());
+		return -1;
+	}
+	const uint64_t pause = ScopedDuration<CLOCK_MONOTONIC>::nanos_now() - t0;
+	snapshots.taken ++;
+	snapshots.last_pause = pause;
+	if (pause > snapshots.max_pause.load())
+		snapshots.max_pause = pause;
 	return 0;
 }
 
@@ -742,6 +2188,8 @@ long ProgramInstance::live_update_call(const vrt_ctx* ctx,
 	[&] () -> long
 	{
 		try {
+			std::scoped_lock gate(storage().gate);
+			StorageWrite write(storage());
 			/* Serialize data in the old machine */
 			storage().storage_vm->set_ctx(ctx);
 			auto& old_machine = storage().storage_vm->machine();
@@ -773,6 +2221,8 @@ long ProgramInstance::live_update_call(const vrt_ctx* ctx,
 	[&] () -> long
 	{
 		try {
+			std::scoped_lock gate(new_prog.storage().gate);
+			StorageWrite write(new_prog.storage());
 			auto &new_machine = new_prog.storage().storage_vm->machine();
 			/* Begin resume procedure */
 			new_prog.storage().storage_vm->set_ctx(ctx);
@@ -851,16 +2301,15 @@ bool ProgramInstance::load_state(void* state_area)
 	return true;
 }
 
+int ProgramInstance::queue_depth() const noexcept
+{
+	return m_lane_waiters.load(std::memory_order_relaxed);
+}
+
 int ProgramInstance::numa_node()
 {
-#ifdef __x86_64__
-	unsigned long a,d,c;
-	__asm__ volatile("rdtscp" : "=a" (a), "=d" (d), "=c" (c));
-	return c >> 12;
-#else
-	unsigned cpu_id, node_id;
-	return (getcpu(&cpu_id, &node_id) ? 0 : node_id);
-#endif
+	/* Node index, never higher than the number of VM queues. */
+	return NumaTopology::get().current_node() % 4;
 }
 
 } // kvm
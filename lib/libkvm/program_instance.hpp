@@ -1,12 +1,21 @@
 #pragma once
 #include "binary_storage.hpp"
+#include "budget.hpp"
+#include "cold_start.hpp"
 #include "instance_cache.hpp"
 #include "machine_instance.hpp"
 #include "settings.hpp"
+#include "snapshot_cache.hpp"
+#include "storage_mailbox.hpp"
 #include "server/epoll.hpp"
 #include "server/websocket.hpp"
 #include "serialized_state.hpp"
 #include "utils/cpptime.hpp"
+#include "utils/latency_histogram.hpp"
+#include "utils/rw_gate.hpp"
+#include "utils/vm_handoff.hpp"
+#include <atomic>
+#include <exception>
 #include <blockingconcurrentqueue.h>
 #include <tinykvm/util/threadpool.h>
 #include <tinykvm/util/threadtask.hpp>
@@ -26,6 +35,16 @@ struct VirtBuffer {
 	size_t   len;
 };
 
+/* Thrown when admission control rejects a reservation instead of
+   letting it wait in the queue. */
+struct AdmissionRejected : public std::runtime_error {
+	AdmissionRejected(uint16_t s, uint32_t ra)
+		: std::runtime_error("Request shed by admission control"),
+		  status(s), retry_after(ra) {}
+	const uint16_t status;
+	const uint32_t retry_after; /* Seconds */
+};
+
 /**
  * A pool item is all the bits necessary to execute inside KVM
  * for a particular tenant. The pool item can be requested as
@@ -34,7 +53,21 @@ struct VirtBuffer {
  * data transfers, and is then put back in a blocking queue.
 **/
 struct VMPoolItem {
-	VMPoolItem(unsigned reqid, const MachineInstance&, TenantInstance*, ProgramInstance*);
+	VMPoolItem(unsigned reqid, unsigned node, const MachineInstance&, const TenantInstance*, ProgramInstance*);
+	~VMPoolItem();
+	/* Fork a new VM on the dedicated thread, eg. after being retired. */
+	std::future<long> fork(const MachineInstance&, const TenantInstance*, ProgramInstance*);
+	/* Destroy the forked VM, releasing its memory. Blocking, so the
+	   pool lock (mtx) is only held while taking the machine away. */
+	void retire(std::mutex& mtx);
+	bool is_retired() const noexcept { return mi == nullptr; }
+	/* Run a function on the dedicated thread, and wait for the result. */
+	template <typename F>
+	long call(F&& func);
+
+	const unsigned reqid;
+	// NUMA node index this VM (and its thread) is placed on
+	const unsigned node;
 	// VM instance
 	std::unique_ptr<MachineInstance> mi;
 	// Reference that keeps active program alive
@@ -43,13 +76,75 @@ struct VMPoolItem {
 	tinykvm::ThreadTask<tinykvm::Function<long()>> tp;
 	// We can use this to avoid having to start in a serialized manner
 	std::future<long> task_future;
+	// Calls bypass the thread pool queue, while the dedicated
+	// thread is parked in the handoff loop.
+	VMHandoff<HANDOFF_SPIN_ITERATIONS> handoff;
+	std::future<long> handoff_future;
+	bool handoff_active = false;
+	void start_handoff();
+	void stop_handoff();
+	// Last time this VM was put back in the queue (monotonic nanos)
+	std::atomic<uint64_t> last_released {0};
+	// Free in a queue or a hot slot, until reserved (or retired)
+	std::atomic<bool> in_pool {false};
+	// When the current reservation started (monotonic nanos)
+	uint64_t reserved_at = 0;
+	// When the request ended and the reset was scheduled (monotonic nanos)
+	uint64_t reset_queued_at = 0;
+	// The reset was deferred to the VM's own thread
+	bool reset_deferred = false;
+	// Working memory still banked after the last reset (bytes)
+	uint64_t retained_workmem = 0;
+	// The fork has served a request
+	bool served = false;
 };
 
+template <typename F>
+inline long VMPoolItem::call(F&& func)
+{
+	if (this->handoff_active) {
+		using FT = std::remove_reference_t<F>;
+		return handoff.call(
+			[] (void* f) -> long { return (*(FT*)f)(); }, (void*)&func);
+	}
+	return tp.enqueue(std::forward<F>(func)).get();
+}
+
 struct Reservation {
 	VMPoolItem* slot;
 	priv_task_free_func_t free;
 };
 
+/* A forked view of the storage VM, which runs read-only storage calls.
+   Like request VMs, each view is created and called on its own thread. */
+struct StorageReader {
+	StorageReader(unsigned id);
+	const unsigned reqid;
+	std::unique_ptr<MachineInstance> mi;
+	/* The write epoch of storage when the view was forked */
+	uint64_t epoch = 0;
+	tinykvm::ThreadTask<std::function<long()>> tp;
+};
+
+/* One of the storage VMs that keyed storage calls are spread across,
+   see: storage_shards. Shard 0 is the storage VM itself, which uses the
+   storage queue. Every other shard has its own VM and queue. */
+struct StorageShard {
+	StorageShard(unsigned index);
+	const unsigned index;
+	std::unique_ptr<MachineInstance> vm;
+	std::unique_ptr<tinykvm::ThreadTask<std::function<long()>>> queue;
+	/* Call before enqueueing a call, passing the result to dequeued()
+	   once the call starts running. */
+	uint64_t enqueued() noexcept;
+	void dequeued(uint64_t t0) noexcept;
+
+	std::atomic<uint64_t> calls {0};
+	std::atomic<int> queued {0};
+	std::atomic<int> max_queued {0};
+	LatencyHistogram<LATENCY_HISTOGRAM_SHARDS> wait; /* Nanoseconds */
+};
+
 class Storage {
 public:
 	Storage(BinaryStorage storage_elf);
@@ -59,15 +154,127 @@ public:
 
 	BinaryStorage storage_binary;
 
-	/* Tasks executed in storage outside an active request. */
-	std::deque<std::future<long>> m_async_tasks;
-	std::mutex m_async_mtx;
+	/* Tasks executed in storage outside an active request. Up to
+	   max_queued tasks wait for storage, and the results of the most
+	   recently finished tasks are kept for callers to poll. */
+	struct Task {
+		uint64_t id;
+		uint64_t func;
+		std::string argument;
+		uint64_t t0; /* When the task was queued */
+	};
+	struct TaskResult {
+		uint64_t id;
+		long status; /* See: task_result() */
+		long result;
+	};
+	struct Tasks {
+		std::mutex mtx;
+		unsigned max_queued = STORAGE_TASK_QUEUE_DEPTH;
+		/* On overflow, replace the argument of a queued task calling
+		   the same function, instead of rejecting the new task. */
+		bool coalesce = false;
+		uint64_t next_id = 1;
+		std::deque<Task> queue;
+		std::deque<TaskResult> results; /* Oldest first */
+
+		std::atomic<uint64_t> tasks {0};
+		std::atomic<uint64_t> completed {0};
+		std::atomic<uint64_t> failed {0};
+		std::atomic<uint64_t> dropped {0};
+		std::atomic<uint64_t> coalesced {0};
+		std::atomic<int> queued {0};
+		std::atomic<int> running {0};
+		LatencyHistogram<LATENCY_HISTOGRAM_SHARDS> wait; /* Nanoseconds */
+		LatencyHistogram<LATENCY_HISTOGRAM_SHARDS> run;
+	} tasks;
+	/* Returns 1 when the task has finished, writing its result, 0 while
+	   it is queued or running, -1 when it failed and -2 when the task is
+	   unknown, or too old to have its result kept. */
+	long task_result(uint64_t id, long& result);
 
 	std::unordered_set<uint64_t> allow_list;
 
 	bool is_allowed(uint64_t address) const noexcept {
 		return allow_list.empty() || (allow_list.count(address) != 0);
 	}
+	/* Allowed functions that only read storage, see: STORAGE_ALLOW_READONLY. */
+	std::unordered_set<uint64_t> readonly_list;
+	bool is_readonly(uint64_t address) const noexcept {
+		return readonly_list.count(address) != 0;
+	}
+
+	/* Read-only calls run concurrently on forked views of the storage
+	   VM, holding the gate shared. Everything else that runs in the
+	   storage VM holds the gate exclusively. The views share the memory
+	   of the storage VM, and see what storage writes to it. A new write
+	   epoch starts when storage maps new memory, and the views are then
+	   forked again. See: StorageWrite. */
+	RWGate gate;
+	std::atomic<uint64_t> write_epoch {0};
+	std::deque<StorageReader> readers;
+	moodycamel::BlockingConcurrentQueue<StorageReader*> free_readers;
+	struct Reads {
+		std::atomic<uint64_t> calls {0};
+		std::atomic<uint64_t> forks {0};
+		std::atomic<int> active {0};
+		std::atomic<int> max_active {0};
+	} reads;
+
+	/* Buffers in storage memory that requests pass by reference. */
+	StorageMailbox mailbox;
+
+	/* Storage calls that find other calls waiting for storage are run
+	   together, up to batch_max at a time, with one call into the batch
+	   entry point of the storage program. See: STORAGE_ALLOW_BATCH. */
+	struct BatchedCall {
+		tinykvm::Machine* src;
+		uint64_t func;
+		size_t n;
+		VirtBuffer* buffers;
+		uint64_t res_addr;
+		size_t res_size;
+		uint64_t t0; /* When the call was queued */
+		long result = -1;
+		std::exception_ptr error; /* Rethrown in the caller */
+		moodycamel::LightweightSemaphore done;
+	};
+	uint64_t batch_entry = 0;
+	unsigned batch_max = 0; /* Zero when batching is disabled */
+	std::mutex batch_mtx;
+	std::vector<BatchedCall*> batch_pending;
+	bool batch_scheduled = false;
+	struct Batches {
+		std::atomic<uint64_t> batches {0};
+		std::atomic<uint64_t> calls {0};
+		std::atomic<unsigned> max_size {0};
+	} batches;
+
+	/* Shards of storage, where the first is the storage VM above. Keys
+	   are mixed before selecting a shard, so that keys that are not
+	   well distributed (eg. sequential numbers) still spread evenly. */
+	std::deque<StorageShard> shards;
+	StorageShard& shard_of(uint64_t key) noexcept {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return shards[key % shards.size()];
+	}
+
+	/* Snapshots of the storage VM, taken on the storage thread between
+	   storage calls, and restored instead of running through main. */
+	std::string snapshot_file;
+	struct Snapshots {
+		bool restored = false;
+		uint64_t restore_time = 0; /* Nanoseconds */
+		std::atomic<uint64_t> taken {0};
+		std::atomic<uint64_t> last_pause {0}; /* Nanoseconds */
+		std::atomic<uint64_t> max_pause {0};
+		std::atomic<uint64_t> next_due {0}; /* Monotonic nanoseconds */
+		std::atomic<bool> dirty {false};
+	} snapshots;
+	void save_state(void* state_area) const;
+	bool load_state(const void* state_area);
 };
 
 /**
@@ -95,6 +302,17 @@ public:
 	ProgramInstance(const std::string& uri, std::string ifmodsince,
 		const vrt_ctx*, TenantInstance*, bool debug = false);
 	~ProgramInstance();
+	/* Programs are created with make(), so that they are never destroyed
+	   on the thread of one of their own request VMs (see: destroy()), and
+	   so that the global budget can reference them weakly. */
+	template <typename... Args>
+	static std::shared_ptr<ProgramInstance> make(Args&&... args) {
+		std::shared_ptr<ProgramInstance> prog(
+			new ProgramInstance(std::forward<Args>(args)...), &ProgramInstance::destroy);
+		Budget::get().add_program(prog);
+		return prog;
+	}
+	static void destroy(ProgramInstance*);
 	long wait_for_initialization();
 	bool is_initialized() const noexcept { return this->m_initialization_complete > 0; }
 
@@ -125,7 +343,12 @@ public:
 
 	/* Reserve VM from blocking queue. */
 	Reservation reserve_vm(const vrt_ctx*,
-		TenantInstance*, std::shared_ptr<ProgramInstance>, bool soft_reset = false);
+		TenantInstance*, std::shared_ptr<ProgramInstance>, bool soft_reset = false,
+		unsigned priority = PRIORITY_DEFAULT);
+	/* Put a VM that is ready for a new request back in the pool. */
+	void release_vm(VMPoolItem*);
+	/* Reset a VM after a request, and then release it. */
+	static long reset_and_release(VMPoolItem*);
 	/* Free a reserved VM. This can potentially finish a program. */
 #ifdef VARNISH_PLUS
 	static void vm_free_function(void*);
@@ -138,9 +361,23 @@ public:
 	long storage_call(tinykvm::Machine& src,
 		gaddr_t func, size_t n, VirtBuffer[], gaddr_t, size_t);
 
-	/* Async serialized vmcall into storage VM. */
+	/* Concurrent vmcall into a forked view of the storage VM, for
+	   functions registered as read-only. */
+	long storage_read_call(tinykvm::Machine& src,
+		gaddr_t func, size_t n, VirtBuffer[], gaddr_t, size_t);
+
+	/* Serialized vmcall into the storage shard selected by the key. */
+	long storage_call_key(tinykvm::Machine& src, uint64_t key,
+		gaddr_t func, size_t n, VirtBuffer[], gaddr_t, size_t);
+
+	/* Async serialized vmcall into storage VM. Returns the id of the
+	   queued task, or -1 when the task queue is full. */
 	long storage_task(gaddr_t func, std::string argument);
 
+	/* Snapshot the storage VM, when it has been called since the last
+	   snapshot (or when forced). Runs on the storage queue. */
+	long storage_snapshot(bool force);
+
 	/* Serialized call into storage VM during live update */
 	long live_update_call(const vrt_ctx*,
 		gaddr_t func, ProgramInstance& new_prog, gaddr_t newfunc);
@@ -153,8 +390,41 @@ public:
 
 	/* Ticket-machine that gives access rights to VMs. */
 	std::array<moodycamel::BlockingConcurrentQueue<VMPoolItem*>, 4> m_vmqueue;
-	/* Simple container for VMs. */
+	/* Simple container for VMs. Retired VMs stay in the container,
+	   but without a forked machine. Growing, retiring and iterating
+	   the VMs happens under m_vms_mtx. */
 	std::deque<VMPoolItem> m_vms;
+	std::mutex m_vms_mtx;
+	/* The most recently released VM on each node is handed out before
+	   the queue, as its caches and page tables are still warm. */
+	struct alignas(64) HotSlot {
+		std::atomic<VMPoolItem*> vm {nullptr};
+	};
+	std::array<HotSlot, 4> m_hot_vm;
+	/* Reservations that find no free VM wait in one lane per priority.
+	   Released VMs are handed directly to a waiter, choosing between
+	   the non-empty lanes by smooth weighted round-robin. Waiters live
+	   on the stack of the waiting thread. */
+	struct VMWaiter {
+		VMWaiter(unsigned n) : node {n} {}
+		const unsigned node;
+		VMWaiter* next = nullptr;
+		VMPoolItem* slot = nullptr;
+		moodycamel::LightweightSemaphore sema;
+	};
+	struct Lane {
+		VMWaiter* head = nullptr;
+		VMWaiter* tail = nullptr;
+		int credit = 0;
+	};
+	std::array<Lane, NUM_PRIORITIES> m_lanes;
+	std::mutex m_lanes_mtx;
+	/* Waiting reservations, which makes releases skip the hot VM. */
+	std::atomic<int> m_lane_waiters {0};
+	/* Number of VMs currently forked and part of the pool. */
+	size_t pool_size() const noexcept { return m_pool_size; }
+	/* Number of NUMA nodes the VMs are spread across. */
+	unsigned num_nodes() const noexcept { return m_num_nodes; }
 
 	std::unique_ptr<Storage> m_storage = nullptr;
 	bool has_storage() const noexcept { return m_storage != nullptr; }
@@ -174,7 +444,8 @@ public:
 	   things, like the storage and request VMs. Timers carry capture
 	   storage referring to the other program members. */
 	cpptime::TimerSystem m_timer_system;
-
+	/* Periodic pool maintenance, only present for elastic pools. */
+	std::unique_ptr<cpptime::TimerSystem> m_pool_timer = nullptr;
 
 	/* Live debugging feature using the GDB RSP protocol.
 	   Debugging allows stepping through the tenants program line by line
@@ -190,12 +461,160 @@ public:
 		uint64_t reservation_timeouts = 0;
 		uint64_t live_updates = 0;
 		int64_t  live_update_transfer_bytes = 0;
+		uint64_t pool_scale_ups = 0;
+		uint64_t pool_scale_downs = 0;
+		uint64_t numa_steals = 0;
+		uint64_t requests_shed = 0;
+		uint64_t scale_to_zero = 0;
+		uint64_t cold_restores = 0;
+		uint64_t memory_reclaimed = 0; /* Bytes */
+		uint64_t budget_evictions = 0;
+		uint64_t standby_forks = 0;
+		uint64_t reset_handoffs = 0;
 	} stats;
+	/* Moving average of time spent waiting for a request VM. */
+	uint64_t reservation_wait_ewma() const noexcept {
+		return m_resv_wait_ewma.load(std::memory_order_relaxed);
+	}
+	/* Idle programs can be evicted from the global budget (see Budget). */
+	bool is_idle() const noexcept {
+		return m_pool_size.load() > 0 && m_vms_in_use.load() == 0 && queue_depth() == 0;
+	}
+	uint64_t last_reserved() const noexcept {
+		return m_last_reserved.load(std::memory_order_relaxed);
+	}
+	/* Retire all free request VMs, returning how many were retired. */
+	size_t pool_evict();
+	/* Memory committed to the global budget by this program. */
+	uint64_t budget_memory() const noexcept { return m_budget_memory.load(); }
+	/* Working memory kept by resets, above which a reset frees memory. */
+	uint64_t workmem_limit() const noexcept {
+		return m_workmem.limit.load(std::memory_order_relaxed);
+	}
+	/* Adaptive working memory retention. The working memory of each
+	   request is tracked as a decaying peak, and the limit follows it,
+	   so that most requests find their memory already banked, while
+	   memory from rare large requests is given back. The configured
+	   limit_workmem_after_req is the upper bound. */
+	struct WorkingMemory {
+		std::atomic<uint64_t> limit {~0ull}; /* Bytes */
+		std::atomic<uint64_t> cap {~0ull};
+		std::atomic<uint64_t> peak {0};
+		/* Moving averages with alpha = 1/8 */
+		std::atomic<uint64_t> banked_avg {0};
+		std::atomic<uint64_t> refaulted_avg {0}; /* Banked again after a reset */
+		std::atomic<uint64_t> reset_avg {0}; /* Nanoseconds */
+		std::atomic<uint64_t> full_resets {0};
+		bool adaptive = false;
+	};
+	const WorkingMemory& working_memory() const noexcept { return m_workmem; }
+	/* Restoring the main VM from a cold start snapshot, see: ColdStart. */
+	const ColdStart& cold_start() const noexcept { return m_cold_start; }
+	/* The snapshot of the main VM: the cold start file, or a snapshot
+	   cache entry. Empty when the program is not snapshotted. */
+	const std::string& snapshot_file() const noexcept { return m_snapshot_file; }
+	const SnapshotCache::Entry& snapshot_entry() const noexcept { return m_snapshot_entry; }
+	/* Warming up the main VM, written once during initialization.
+	   See: TenantGroup::Warmup. Times are in nanoseconds. */
+	struct Warmup {
+		uint32_t requests = 0;
+		uint32_t passes = 0; /* Complete passes over the warmup requests */
+		uint64_t duration = 0;
+		uint64_t first_pass = 0;
+		uint64_t best_pass = 0;
+	} warmup;
+	/* Moving average of time from reservation until release. */
+	uint64_t service_time_ewma() const noexcept {
+		return m_service_ewma.load(std::memory_order_relaxed);
+	}
+	/* Latency distributions, in nanoseconds. */
+	using Histogram = LatencyHistogram<LATENCY_HISTOGRAM_SHARDS>;
+	struct Latencies {
+		Histogram reservation_wait;
+		Histogram vm_call;
+		Histogram reset;
+		Histogram reset_incremental; /* Restoring only the dirtied pages. */
+		Histogram reset_full; /* Discarding all working memory. */
+		Histogram reset_completion; /* From request end until ready again. */
+		Histogram request; /* From reservation until release. */
+		std::array<Histogram, NUM_PRIORITIES> reservation_wait_by_priority;
+		Histogram cold_restore; /* Forking a VM for a scaled-to-zero pool. */
+		Histogram prefault; /* Running the warmup request in a new fork. */
+		Histogram first_request; /* The first request served by each fork. */
+	} latency;
+	/* Number of requests currently waiting for a request VM. */
+	int queue_depth() const noexcept;
+	/* Number of request VMs currently reserved. */
+	int vms_in_use() const noexcept {
+		return m_vms_in_use.load(std::memory_order_relaxed);
+	}
+	/* Number of reserved request VMs that are being reset. */
+	int vms_resetting() const noexcept {
+		return m_vms_resetting.load(std::memory_order_relaxed);
+	}
 
 	static int numa_node();
 
 private:
 	void begin_initialization(const vrt_ctx *, TenantInstance *, bool debug);
+	/* Reserve and prefault the storage mailbox in the storage VM. */
+	void start_storage_mailbox(uint64_t size);
+	/* Fork the views of the storage VM used by read-only storage calls. */
+	void start_storage_readers(unsigned count);
+	/* Boot the storage VMs of the shards after the first. */
+	void start_storage_shards(const vrt_ctx*, TenantInstance*, unsigned count);
+	/* Take over a storage snapshot file, discarding the snapshot when
+	   it belongs to another storage program or is in use. */
+	void prepare_storage_snapshot(const std::string& path);
+	/* Queue a storage call to be run in the next batch, and wait for it.
+	   Batches run on the storage queue, see: Storage::BatchedCall. */
+	long storage_batch_call(tinykvm::Machine& src,
+		gaddr_t func, size_t n, VirtBuffer[], gaddr_t, size_t);
+	long storage_batch_run();
+	/* Run the oldest queued storage task, see: Storage::Tasks. */
+	long storage_task_run();
+	/* Queue a snapshot of a storage VM that was just called, when due. */
+	void schedule_storage_snapshot();
+	/* Elastic request VM pool. Grows when the measured reservation
+	   wait is above the groups threshold, and retires VMs that have
+	   been idle for long enough, down to min_concurrency. */
+	void pool_autoscale(const TenantInstance*);
+	bool pool_grow(const TenantInstance*);
+	bool pool_retire_idle(uint64_t now, uint64_t idle_ns);
+	/* Fork VMs until standby_vms VMs are free, up to max_concurrency. */
+	void pool_standby(const TenantInstance*);
+	/* Retire every request VM once the program has been idle for
+	   scale_to_zero_ms, and grow a woken pool back afterwards. */
+	void pool_scale_to_zero(const TenantInstance*);
+	/* Fork a VM for a reservation that found the pool empty. Returns
+	   false when no VM could be forked. */
+	bool pool_wake(const TenantInstance*);
+	/* Retire every free VM, stopping early when a reservation starts
+	   waiting. Without wake, a pool retired down to zero VMs is not
+	   woken up again for waiting reservations, and instead keeps the
+	   VMs they would be waiting for. */
+	size_t retire_free_vms(const TenantInstance*, bool wake = true);
+	/* Commit to, and release from, the global budget (see Budget). */
+	bool budget_commit(uint64_t memory, uint64_t vms);
+	void budget_release(uint64_t memory, uint64_t vms) noexcept;
+	/* Record the working memory of a request before its reset, and
+	   tune the working memory limit. */
+	void workmem_sample(uint64_t banked, uint64_t retained, uint64_t reset_ns, bool full_reset);
+	/* Throws AdmissionRejected when a reservation that would have to
+	   wait is expected to wait for too long. */
+	void admission_control(const TenantInstance*);
+	/* Take a free VM without blocking, local node first. */
+	VMPoolItem* try_dequeue_vm(unsigned node);
+	/* Also considers the hot VMs of every node. */
+	VMPoolItem* take_free_vm(unsigned node);
+	/* Wait in the priority lane until a VM is handed over, or the
+	   timeout expires, in which case nullptr is returned. */
+	VMPoolItem* wait_for_vm(const TenantInstance*, unsigned node, unsigned priority,
+		std::chrono::microseconds);
+	/* Make a VM available, handing it to a waiter if there is one. */
+	void enqueue_vm(VMPoolItem*);
+	void dispatch_waiters();
+	void dispatch_locked(); /* Requires m_lanes_mtx */
 	uint64_t download_dependencies(const TenantInstance* ten);
 	/* Wait for Varnish to listen and this program to complete initialization. */
 	void try_wait_for_startup_and_initialization();
@@ -208,6 +627,24 @@ private:
 	std::future<long> m_async_start_future;
 	std::mutex mtx_future_init;
 	int8_t m_initialization_complete = 0;
+	bool m_elastic_pool = false;
+	unsigned m_num_nodes = 1;
+	bool m_lifo_handoff = false;
+	std::atomic<size_t> m_pool_size {0};
+	std::atomic<uint64_t> m_last_reserved {0}; /* Monotonic nanoseconds */
+	std::mutex m_wake_mtx;
+	const TenantInstance* m_pool_tenant = nullptr;
+	uint64_t m_vm_budget = 0; /* Bytes committed per request VM */
+	std::atomic<uint64_t> m_budget_memory {0};
+	std::atomic<uint64_t> m_budget_vms {0};
+	std::atomic<uint64_t> m_resv_wait_ewma {0}; /* Nanoseconds */
+	std::atomic<uint64_t> m_service_ewma {0}; /* Nanoseconds */
+	std::atomic<int> m_vms_in_use {0};
+	std::atomic<int> m_vms_resetting {0};
+	WorkingMemory m_workmem;
+	ColdStart m_cold_start;
+	std::string m_snapshot_file;
+	SnapshotCache::Entry m_snapshot_entry;
 	bool m_binary_was_local = false;
 	bool m_binary_was_cached = false;
 	// EpollServer is to allow WebSockets and other non-HTTP protocols
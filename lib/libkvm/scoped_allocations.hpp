@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+
+/* Provided by an optional allocation hook, eg. an LD_PRELOAD library
+   wrapping malloc(), returning the heap allocations made so far by
+   the calling thread. See tests/zero_alloc.vtc for an example. */
+extern "C" uint64_t kvm_thread_allocations() __attribute__((weak));
+
+namespace kvm
+{
+	struct ScopedAllocations {
+		ScopedAllocations(uint64_t& dest_counter)
+			: m_counter(dest_counter), a0(now())  {}
+		~ScopedAllocations() {
+			m_counter += now() - a0;
+		}
+
+		static bool enabled() noexcept {
+			return kvm_thread_allocations != nullptr;
+		}
+		static inline uint64_t now() noexcept {
+			return enabled() ? kvm_thread_allocations() : 0;
+		}
+
+	private:
+		uint64_t& m_counter;
+		const uint64_t a0;
+	};
+} // kvm
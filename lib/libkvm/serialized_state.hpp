@@ -25,4 +25,20 @@ struct SerializedState {
 	   NOTE: Limiting the entries to lower 32-bits, for now. */
 	std::array<uint32_t, (size_t)ProgramEntryIndex::TOTAL_ENTRIES> entry_address {};
 };
+
+struct SerializedStorageState {
+	/* Storage functions allowed to be called from requests, which is
+	   usually a handful. Storage VMs allowing more than this many
+	   functions are not snapshotted. */
+	static constexpr size_t MAX_ALLOWED = 64;
+	uint32_t allowed_count = 0;
+	std::array<uint64_t, MAX_ALLOWED> allowed {};
+	/* Bit N is set when allowed[N] is read-only */
+	uint64_t readonly_mask = 0;
+	/* The batch entry point, see: STORAGE_ALLOW_BATCH */
+	uint64_t batch_entry = 0;
+	/* The storage mailbox, see: StorageMailbox */
+	uint64_t mailbox_base = 0;
+	uint64_t mailbox_size = 0;
+};
 }
\ No newline at end of file
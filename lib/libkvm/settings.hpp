@@ -13,19 +13,56 @@ namespace kvm
     static constexpr float  STARTUP_TIMEOUT = 16.0f;
 
     static constexpr uint32_t RESV_QUEUE_TIMEOUT = 60; /* Seconds */
+    static constexpr uint16_t ADMISSION_SHED_STATUS = 503;
     static constexpr size_t REQUEST_MEMORY_SIZE = 64; /* 64MB */
     static constexpr int    REQUEST_VM_NICE = 10;
     static constexpr float  REQUEST_VM_TIMEOUT = 8.0f;
     static constexpr float  STREAM_HANDLING_TIMEOUT = 2.0f;
     static constexpr float  ERROR_HANDLING_TIMEOUT = 1.0f;
+    static constexpr unsigned HANDOFF_SPIN_ITERATIONS = 4000;
+    /* Scratch memory of a request VM kept between requests */
+    static constexpr size_t SCRATCH_RETAIN_SIZE = 1UL << 20; /* 1MB */
+    /* Elastic request VM pool */
+    static constexpr uint32_t POOL_AUTOSCALE_INTERVAL_MS = 100;
+    static constexpr uint32_t POOL_SCALE_UP_WAIT_MS = 2;
+    static constexpr uint32_t POOL_SCALE_DOWN_IDLE_MS = 30'000;
+    /* A woken pool grows back while it has had requests this recently */
+    static constexpr uint32_t POOL_GROW_BACK_ACTIVE_MS = 1000;
+    /* Adaptive working memory: the peak decays by 1/N per request */
+    static constexpr uint64_t WORKMEM_PEAK_DECAY = 16;
+    static constexpr uint64_t WORKMEM_BANK_SIZE = 2UL << 20; /* 2MB */
+    /* Cold start snapshots: the hot set is recorded after N requests */
+    static constexpr int    COLD_START_HOT_SET_REQUESTS = 100;
+    static constexpr size_t COLD_START_READ_SIZE = 2UL << 20; /* 2MB */
+    /* Requests in a warmup corpus file, see: TenantGroup::Warmup */
+    static constexpr size_t WARMUP_CORPUS_MAX_REQUESTS = 10'000;
+    /* Reservation priority classes, see: enum kvm_priority */
+    static constexpr unsigned PRIORITY_INTERACTIVE = 0;
+    static constexpr unsigned PRIORITY_DEFAULT = 1;
+    static constexpr unsigned PRIORITY_BACKGROUND = 2;
+    static constexpr unsigned NUM_PRIORITIES = 3;
+    /* Share of free VMs given to each waiting priority class */
+    static constexpr unsigned PRIORITY_WEIGHTS[NUM_PRIORITIES] = { 8, 4, 1 };
+    /* Latency histograms, and how often they are published to VSC */
+    static constexpr unsigned LATENCY_HISTOGRAM_SHARDS = 8;
+    static constexpr uint64_t LATENCY_VSC_INTERVAL_NS = 1'000'000'000;
+    /* Files remembered by the shared library cache (LRU) */
+    static constexpr size_t SHARED_OBJECT_CACHE_ENTRIES = 1024;
 
     /* Serialized storage VM access */
     static constexpr int    STORAGE_VM_NICE = 10;
     static constexpr float  STORAGE_TIMEOUT = 10.0f;
     static constexpr float  STORAGE_CLEANUP_TIMEOUT = 1.0f;
     static constexpr float  STORAGE_DESERIALIZE_TIMEOUT = 2.0f;
+    static constexpr uint32_t STORAGE_SNAPSHOT_INTERVAL_MS = 10'000;
+    static constexpr uint16_t STORAGE_MAX_SHARDS = 64;
+    static constexpr uint16_t STORAGE_MAX_READERS = 64;
+    static constexpr uint16_t STORAGE_MAX_BATCH = 256;
     static constexpr size_t STORAGE_TASK_MAX_ARGUMENT = 2UL << 20; /* 2MB */
     static constexpr int    STORAGE_TASK_MAX_TIMERS = 15;
+    static constexpr uint16_t STORAGE_TASK_QUEUE_DEPTH = 16;
+    static constexpr uint16_t STORAGE_TASK_MAX_QUEUE = 4096;
+    static constexpr size_t STORAGE_TASK_MAX_RESULTS = 64;
     /* Async storage VM access */
     static constexpr float ASYNC_STORAGE_TIMEOUT = 15.0f;
     static constexpr int   ASYNC_STORAGE_NICE = 15;
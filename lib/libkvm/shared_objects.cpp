@@ -0,0 +1,206 @@
+#include "shared_objects.hpp"
+
+#include "mmap_file.hpp"
+#include "settings.hpp"
+#include "utils/crc32.hpp"
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+extern "C" {
+void kvm_varnishstat_shared_object(int hit, uint64_t bytes);
+}
+
+namespace kvm
+{
+	SharedObjectCache& SharedObjectCache::get()
+	{
+		static SharedObjectCache cache;
+		return cache;
+	}
+
+	bool SharedObjectCache::is_shared_object(const std::string& path)
+	{
+		// Matches libfoo.so and versioned names like libc.so.6
+		const size_t slash = path.rfind('/');
+		const size_t so = path.find(".so", slash == std::string::npos ? 0 : slash);
+		if (so == std::string::npos)
+			return false;
+		return so + 3 == path.size()
+			|| (path[so + 3] == '.' && isdigit((unsigned char)path[so + 4]));
+	}
+
+	void SharedObjectCache::add_writable_path(const std::string& path)
+	{
+		std::scoped_lock lock(m_mtx);
+		m_writable_paths.push_back(path);
+	}
+
+	SharedObjectCache::FileId SharedObjectCache::FileId::of(const struct stat& st) noexcept
+	{
+		const uint64_t mtime =
+			uint64_t(st.st_mtim.tv_sec) * 1'000'000'000ull + st.st_mtim.tv_nsec;
+		return FileId{uint64_t(st.st_dev), uint64_t(st.st_ino), mtime, uint64_t(st.st_size)};
+	}
+
+	bool SharedObjectCache::FileId::operator==(const FileId& other) const noexcept
+	{
+		return this->dev == other.dev && this->ino == other.ino
+			&& this->mtime == other.mtime && this->size == other.size;
+	}
+
+	static bool root_owned(const struct stat& st) noexcept
+	{
+		return st.st_uid == 0 && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+	}
+
+	bool SharedObjectCache::trusted(const std::string& path)
+	{
+		if (path.empty() || path[0] != '/' || path.find("/../") != std::string::npos)
+			return false;
+		{
+			std::scoped_lock lock(m_mtx);
+			for (const auto& writable : m_writable_paths) {
+				if (path.compare(0, writable.size(), writable) == 0)
+					return false;
+			}
+		}
+		// lstat() fails the checks below for symlinks, so that no
+		// component of the path can be replaced by another user.
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || !root_owned(st))
+			return false;
+		for (size_t slash = path.rfind('/'); slash != std::string::npos && slash > 0;
+			slash = path.rfind('/', slash - 1))
+		{
+			const std::string dir = path.substr(0, slash);
+			if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || !root_owned(st))
+				return false;
+		}
+		return lstat("/", &st) == 0 && root_owned(st);
+	}
+
+	bool SharedObjectCache::unchanged(const std::string& path, const FileId& id)
+	{
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || !root_owned(st))
+			return false;
+		return FileId::of(st) == id;
+	}
+
+	bool SharedObjectCache::same_contents(const std::string& path, const FileId& id,
+		const void* data, size_t size)
+	{
+		const int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		bool same = false;
+		if (fstat(fd, &st) == 0 && FileId::of(st) == id && root_owned(st) && id.size == size) {
+			void* other = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (other != MAP_FAILED) {
+				same = std::memcmp(other, data, size) == 0;
+				munmap(other, size);
+			}
+		}
+		close(fd);
+		return same;
+	}
+
+	void SharedObjectCache::insert(Entry&& entry)
+	{
+		// Another program may have added the same file meanwhile
+		for (const auto& other : m_entries) {
+			if (other.id == entry.id)
+				return;
+		}
+		if (entry.is_canonical())
+			m_bytes += entry.id.size;
+		m_entries.push_back(std::move(entry));
+		while (m_entries.size() > SHARED_OBJECT_CACHE_ENTRIES) {
+			// Entries that refer to a dropped canonical entry stay
+			// valid, as they verify the canonical file on their own.
+			if (m_entries.front().is_canonical())
+				m_bytes -= m_entries.front().id.size;
+			m_entries.pop_front();
+		}
+	}
+
+	void SharedObjectCache::canonicalize(std::string& path)
+	{
+		if (!is_shared_object(path))
+			return;
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+			return;
+		const FileId id = FileId::of(st);
+
+		// Files we have seen before, by identity
+		std::string canonical;
+		FileId canonical_id;
+		uint64_t bytes = 0;
+		bool found = false;
+		{
+			std::scoped_lock lock(m_mtx);
+			for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+				if (it->id == id) {
+					m_entries.splice(m_entries.end(), m_entries, it);
+					canonical = it->path;
+					canonical_id = it->canonical;
+					bytes = m_bytes;
+					found = true;
+					break;
+				}
+			}
+		}
+		if (found) {
+			// The same file is already shared through the page cache
+			if (canonical_id == id)
+				return;
+			// The canonical file may have been replaced since
+			if (!unchanged(canonical, canonical_id))
+				return;
+			path = std::move(canonical);
+			kvm_varnishstat_shared_object(1, bytes);
+			return;
+		}
+
+		// A file we have not seen before, which may still be a copy
+		// of a trusted object that we have seen. Reading and comparing
+		// the files happens without holding the lock.
+		Entry entry {id, 0, path, id, this->trusted(path)};
+		try {
+			MmapFile mapping(path);
+			if (mapping.size() != id.size)
+				return; /* Changed while we looked at it */
+			entry.crc = crc32c_hw((const char *)mapping.data(), mapping.size());
+
+			std::vector<std::pair<std::string, FileId>> candidates;
+			{
+				std::scoped_lock lock(m_mtx);
+				for (const auto& other : m_entries) {
+					if (other.is_canonical() && other.trusted && other.crc == entry.crc
+						&& other.id.size == id.size)
+						candidates.emplace_back(other.path, other.id);
+				}
+			}
+			for (const auto& [other_path, other_id] : candidates) {
+				if (same_contents(other_path, other_id, mapping.data(), mapping.size())) {
+					entry.path = other_path;
+					entry.canonical = other_id;
+					break;
+				}
+			}
+		} catch (const std::exception&) {
+			return; /* Let the VM open the file as usual */
+		}
+
+		const bool hit = !entry.is_canonical();
+		if (hit)
+			path = entry.path;
+		std::scoped_lock lock(m_mtx);
+		this->insert(std::move(entry));
+		kvm_varnishstat_shared_object(hit ? 1 : 0, m_bytes);
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <sys/stat.h>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kvm
+{
+	/* Host-side cache of the shared objects that dynamic programs load
+	   through the allowed paths, eg. libc and libstdc++. Objects are
+	   identified by (device, inode, mtime, size), and then by content,
+	   so that identical libraries installed under different paths are
+	   all opened through one trusted path. Their read-only pages are
+	   then mapped from a single page cache entry into every VM.
+	   Only files that no tenant can change are opened in place of
+	   others, see: trusted(). Only the identity and checksum of each
+	   file is kept, and the least recently used entries are dropped
+	   beyond a fixed count. */
+	struct SharedObjectCache {
+		static SharedObjectCache& get();
+
+		/* Rewrite the path of a shared object to the canonical path of
+		   an identical, trusted object, if one has been opened before. */
+		void canonicalize(std::string& path);
+
+		/* Files under writable allowed paths are never trusted. */
+		void add_writable_path(const std::string& path);
+
+		static bool is_shared_object(const std::string& path);
+
+	private:
+		SharedObjectCache() = default;
+
+		struct FileId {
+			uint64_t dev;
+			uint64_t ino;
+			uint64_t mtime; /* Nanoseconds */
+			uint64_t size;
+
+			static FileId of(const struct stat&) noexcept;
+			bool operator==(const FileId&) const noexcept;
+		};
+		struct Entry {
+			FileId id;
+			uint32_t crc;
+			std::string path; /* Canonical path */
+			FileId canonical; /* The file at the canonical path */
+			bool trusted; /* The canonical file may replace others */
+
+			bool is_canonical() const noexcept { return id == canonical; }
+		};
+		/* Owned by root and not writable by others, along with every
+		   directory leading to it, without symlinks, and outside every
+		   writable allowed path. */
+		bool trusted(const std::string& path);
+		/* The file at path is still the trusted file that was cached. */
+		bool unchanged(const std::string& path, const FileId&);
+		/* Compare the contents of a trusted file with data, through a
+		   descriptor that is verified to still be the expected file. */
+		static bool same_contents(const std::string& path, const FileId&,
+			const void* data, size_t size);
+		/* Add an entry, dropping the least recently used ones. */
+		void insert(Entry&&); /* Requires m_mtx */
+		std::mutex m_mtx;
+		/* Most recently used at the back */
+		std::list<Entry> m_entries;
+		uint64_t m_bytes = 0; /* Size of the canonical entries */
+		std::vector<std::string> m_writable_paths;
+	};
+}
@@ -0,0 +1,270 @@
+#include "snapshot_cache.hpp"
+
+#include "cold_start.hpp"
+#include "tenant_instance.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+extern "C" {
+void kvm_varnishstat_snapshot_cache(int hit, uint64_t bytes);
+}
+
+namespace kvm
+{
+	/* Bump when the contents of snapshots change meaning. */
+	static constexpr int SNAPSHOT_CACHE_VERSION = 2;
+	static const char SNAPSHOT_SUFFIX[] = ".snapshot";
+
+	static std::string sha256_hex(const void* data, size_t len)
+	{
+		unsigned char hash[SHA256_DIGEST_LENGTH];
+		SHA256((const unsigned char *)data, len, hash);
+
+		static constexpr char lut[] = "0123456789abcdef";
+		std::string hash_hex(SHA256_DIGEST_LENGTH * 2, 0);
+		for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+			hash_hex[i * 2]     = lut[(hash[i] >> 4) & 0x0F];
+			hash_hex[i * 2 + 1] = lut[hash[i] & 0x0F];
+		}
+		return hash_hex;
+	}
+
+	static std::string snapshot_key(const TenantInstance* ten, const BinaryStorage& binary)
+	{
+		const auto& config = ten->config;
+		const auto& group = config.group;
+		std::string key = "version=" + std::to_string(SNAPSHOT_CACHE_VERSION) + "\n";
+		key += "binary=" + sha256_hex(binary.data(), binary.size()) + "\n";
+		// The program name, group and filename are part of main arguments
+		// and environment, see: MachineInstance::initialize()
+		key += "name=" + config.name + "\n";
+		key += "group=" + group.name + "\n";
+		key += "filename=" + config.filename + "\n";
+		const auto main_arguments = std::atomic_load(&group.main_arguments);
+		if (main_arguments != nullptr) {
+			for (const auto& arg : *main_arguments)
+				key += "arg=" + arg + "\n";
+		}
+		for (const auto& env : config.environ())
+			key += "env=" + env + "\n";
+		key += "cwd=" + group.current_working_directory + "\n";
+		// The memory layout of the main VM
+		key += "max_address_space=" + std::to_string(group.max_address_space) + "\n";
+		key += "max_main_memory=" + std::to_string(group.max_main_memory) + "\n";
+		key += "shared_memory=" + std::to_string(group.shared_memory) + "\n";
+		key += "hugepages=" + std::to_string(config.hugepages()) + "\n";
+		key += "hugepage_arena_size=" + std::to_string(group.hugepage_arena_size) + "\n";
+		key += "transparent_hugepages=" + std::to_string(group.transparent_hugepages) + "\n";
+		key += "relocate_fixed_mmap=" + std::to_string(group.relocate_fixed_mmap) + "\n";
+		key += "executable_heap=" + std::to_string(group.vmem_heap_executable) + "\n";
+		for (const auto& vmem : group.vmem_remappings) {
+			key += "remapping=" + std::to_string(vmem.phys)
+				+ " " + std::to_string(vmem.virt)
+				+ " " + std::to_string(vmem.size)
+				+ " " + std::to_string(vmem.writable)
+				+ " " + std::to_string(vmem.executable)
+				+ " " + std::to_string(vmem.blackout) + "\n";
+		}
+		key += "max_req_mem=" + std::to_string(group.max_req_mem) + "\n";
+		key += "limit_req_mem=" + std::to_string(group.limit_req_mem) + "\n";
+		key += "max_boot_time=" + std::to_string(group.max_boot_time) + "\n";
+		key += "max_regex=" + std::to_string(group.max_regex) + "\n";
+		key += "mmap_backed_files=" + std::to_string(group.mmap_backed_files) + "\n";
+		key += "shared_library_cache=" + std::to_string(group.shared_library_cache) + "\n";
+		// The files that main may have opened and read
+		for (const auto& path : group.allowed_paths) {
+			key += "allowed_path=" + path.real_path + " " + path.virtual_path
+				+ " " + std::to_string(path.writable)
+				+ " " + std::to_string(path.symlink)
+				+ " " + std::to_string(path.usable_in_fork)
+				+ " " + std::to_string(path.prefix) + "\n";
+		}
+		key += "allowed_file=" + config.allowed_file + "\n";
+		// Warmup runs before the snapshot is taken
+		if (group.warmup) {
+			key += "warmup=" + std::to_string(group.warmup->num_requests)
+				+ " " + std::to_string(group.warmup->exact) + "\n";
+			std::string requests;
+			for (const auto& request : group.warmup->requests) {
+				requests += request.method + " " + request.url + "\n";
+				for (const auto& header : request.headers)
+					requests += header + "\n";
+				requests += request.content_type + "\n";
+				requests += std::to_string(request.body.size()) + "\n" + request.body;
+			}
+			key += "warmup_requests=" + sha256_hex(requests.data(), requests.size()) + "\n";
+		}
+		return key;
+	}
+
+	static bool read_file(const std::string& filename, std::string& contents)
+	{
+		FILE* f = fopen(filename.c_str(), "rb");
+		if (f == nullptr)
+			return false;
+		char buffer[4096];
+		size_t len;
+		while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			contents.append(buffer, len);
+		fclose(f);
+		return true;
+	}
+
+	static void remove_snapshot(const std::string& path) noexcept
+	{
+		unlink(path.c_str());
+		unlink((path + ".key").c_str());
+		unlink(ColdStart::hot_set_file(path).c_str());
+	}
+
+	SnapshotCache& SnapshotCache::get()
+	{
+		static SnapshotCache cache;
+		return cache;
+	}
+
+	void SnapshotCache::configure(const std::string& directory, uint64_t max_size)
+	{
+		if (!directory.empty() && mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+			throw std::runtime_error("Could not create snapshot cache directory: " + directory);
+		std::scoped_lock lock(m_mtx);
+		this->m_directory = directory;
+		this->m_max_size = max_size;
+	}
+
+	SnapshotCache::Entry SnapshotCache::lookup(const TenantInstance* ten, const BinaryStorage& binary)
+	{
+		Entry entry;
+		std::string directory;
+		{
+			std::scoped_lock lock(m_mtx);
+			directory = m_directory;
+		}
+		if (directory.empty() || binary.empty())
+			return entry;
+
+		entry.key = snapshot_key(ten, binary);
+		const std::string path = directory + "/"
+			+ sha256_hex(entry.key.data(), entry.key.size()) + SNAPSHOT_SUFFIX;
+
+		// Snapshots and their keys are published together under the lock
+		std::scoped_lock lock(m_mtx);
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0) {
+			std::string stored_key;
+			if (st.st_size > 0 && read_file(path + ".key", stored_key) && stored_key == entry.key)
+			{
+				// Using a snapshot makes it the most recently used
+				utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+				entry.path = path;
+				entry.hit = true;
+				m_hits ++;
+				kvm_varnishstat_snapshot_cache(1, m_bytes.load());
+				return entry;
+			}
+			// A snapshot that does not match its key is invalid
+			remove_snapshot(path);
+		}
+
+		entry.final_path = path;
+		entry.path = path + "." + std::to_string(getpid())
+			+ "." + std::to_string(m_temporaries++) + ".tmp";
+		m_misses ++;
+		kvm_varnishstat_snapshot_cache(0, m_bytes.load());
+		return entry;
+	}
+
+	void SnapshotCache::store(Entry& entry)
+	{
+		const std::string keyfile = entry.final_path + ".key";
+		const std::string tmpkey = entry.path + ".key";
+		FILE* f = fopen(tmpkey.c_str(), "wb");
+		if (f == nullptr) {
+			this->discard(entry);
+			return;
+		}
+		const size_t count = fwrite(entry.key.data(), 1, entry.key.size(), f);
+		if (fclose(f) != 0 || count != entry.key.size()) {
+			this->discard(entry);
+			return;
+		}
+
+		std::scoped_lock lock(m_mtx);
+		// The snapshot is published before its key, so that a key only
+		// ever belongs to a complete snapshot.
+		if (rename(entry.path.c_str(), entry.final_path.c_str()) != 0
+			|| rename(tmpkey.c_str(), keyfile.c_str()) != 0)
+		{
+			remove_snapshot(entry.path);
+			remove_snapshot(entry.final_path);
+			return;
+		}
+		entry.path = entry.final_path;
+		this->evict(entry.path);
+	}
+
+	void SnapshotCache::discard(const Entry& entry) noexcept
+	{
+		// Only temporary snapshots, published ones may be in use
+		if (!entry.hit && !entry.path.empty() && entry.path != entry.final_path)
+			remove_snapshot(entry.path);
+	}
+
+	void SnapshotCache::evict(const std::string& keep)
+	{
+		struct Snapshot {
+			std::string path;
+			uint64_t size;
+			struct timespec mtime;
+		};
+		std::vector<Snapshot> snapshots;
+		uint64_t total = 0;
+
+		DIR* dir = opendir(m_directory.c_str());
+		if (dir == nullptr)
+			return;
+		static constexpr size_t suffix_len = sizeof(SNAPSHOT_SUFFIX) - 1;
+		while (struct dirent* ent = readdir(dir)) {
+			const std::string name = ent->d_name;
+			if (name.size() <= suffix_len
+				|| name.compare(name.size() - suffix_len, suffix_len, SNAPSHOT_SUFFIX) != 0)
+				continue;
+			const std::string path = m_directory + "/" + name;
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0)
+				continue;
+			// Snapshots are sparse, count what they use on disk
+			const uint64_t size = uint64_t(st.st_blocks) * 512;
+			snapshots.push_back({path, size, st.st_mtim});
+			total += size;
+		}
+		closedir(dir);
+
+		if (m_max_size != 0 && total > m_max_size) {
+			std::sort(snapshots.begin(), snapshots.end(),
+				[] (const Snapshot& a, const Snapshot& b) {
+					if (a.mtime.tv_sec != b.mtime.tv_sec)
+						return a.mtime.tv_sec < b.mtime.tv_sec;
+					return a.mtime.tv_nsec < b.mtime.tv_nsec;
+				});
+			// Programs restored from a removed snapshot keep their mapping
+			for (const auto& snapshot : snapshots) {
+				if (total <= m_max_size)
+					break;
+				if (snapshot.path == keep)
+					continue;
+				remove_snapshot(snapshot.path);
+				total -= snapshot.size;
+			}
+		}
+		this->m_bytes = total;
+		kvm_varnishstat_snapshot_cache(-1, total);
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "binary_storage.hpp"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace kvm
+{
+	class TenantInstance;
+
+	/* A directory of cold start snapshots, created automatically for
+	   programs that do not have a cold_start_file. Snapshots are named
+	   by a hash of everything that decides the state of the main VM after
+	   initialization: the binary, its arguments and environment, and the
+	   memory layout of the group. A program with the same key restores
+	   its main VM from the snapshot instead of running through main, also
+	   after Varnish is restarted. The least recently used snapshots are
+	   removed when the directory grows beyond its size limit. */
+	struct SnapshotCache {
+		static SnapshotCache& get();
+
+		void configure(const std::string& directory, uint64_t max_size);
+
+		struct Entry {
+			std::string path; /* Restored from, or saved to */
+			std::string final_path; /* Where a new snapshot is published */
+			std::string key;
+			bool hit = false;
+		};
+		/* Look up the snapshot of a program. On a miss, the snapshot is
+		   saved to a temporary path and then published with store(). An
+		   empty path means that the cache is disabled. */
+		Entry lookup(const TenantInstance*, const BinaryStorage&);
+		void store(Entry&);
+		void discard(const Entry&) noexcept;
+
+		uint64_t hits() const noexcept { return m_hits.load(); }
+		uint64_t misses() const noexcept { return m_misses.load(); }
+		uint64_t bytes() const noexcept { return m_bytes.load(); }
+
+	private:
+		SnapshotCache() = default;
+		/* Remove the least recently used snapshots above the size limit,
+		   except the one given. Requires m_mtx. */
+		void evict(const std::string& keep);
+
+		std::mutex m_mtx;
+		std::string m_directory;
+		uint64_t m_max_size = 0; /* Bytes, 0: No limit */
+		uint64_t m_temporaries = 0;
+		std::atomic<uint64_t> m_hits {0};
+		std::atomic<uint64_t> m_misses {0};
+		std::atomic<uint64_t> m_bytes {0};
+	};
+}
@@ -0,0 +1,70 @@
+#include "storage_mailbox.hpp"
+
+namespace kvm
+{
+	static constexpr uint64_t MAILBOX_ALIGNMENT = 64;
+
+	void StorageMailbox::init(uint64_t base, uint64_t size)
+	{
+		std::scoped_lock lock(m_mtx);
+		this->m_base = base;
+		this->m_size = size;
+		this->m_head = 0;
+		this->m_ring.clear();
+	}
+
+	uint64_t StorageMailbox::reserve(const void* owner, uint64_t len)
+	{
+		len = (len + MAILBOX_ALIGNMENT - 1) & ~(MAILBOX_ALIGNMENT - 1);
+		if (len == 0 || len > m_size) {
+			stats.full ++;
+			return 0;
+		}
+
+		std::scoped_lock lock(m_mtx);
+		uint64_t offset = 0;
+		if (!m_ring.empty()) {
+			const uint64_t tail = m_ring.front().offset;
+			const bool wrapped = m_ring.back().offset < tail;
+			offset = m_head;
+			if (wrapped) {
+				// The free space is between the head and the tail
+				if (len > tail - m_head) {
+					stats.full ++;
+					return 0;
+				}
+			} else if (len > m_size - m_head) {
+				// Wrap around to the start, in front of the tail
+				if (len > tail) {
+					stats.full ++;
+					return 0;
+				}
+				offset = 0;
+			}
+		}
+		m_ring.push_back({offset, len, owner});
+		this->m_head = offset + len;
+
+		stats.reservations ++;
+		const uint64_t in_use = stats.in_use += len;
+		uint64_t max_in_use = stats.max_in_use.load(std::memory_order_relaxed);
+		while (in_use > max_in_use && !stats.max_in_use.compare_exchange_weak(max_in_use, in_use));
+		return m_base + offset;
+	}
+
+	void StorageMailbox::release(const void* owner)
+	{
+		std::scoped_lock lock(m_mtx);
+		for (auto& desc : m_ring) {
+			if (desc.owner == owner) {
+				desc.owner = nullptr;
+				stats.in_use -= desc.len;
+			}
+		}
+		// The ring only advances past the oldest reservations
+		while (!m_ring.empty() && m_ring.front().owner == nullptr)
+			m_ring.pop_front();
+		if (m_ring.empty())
+			this->m_head = 0;
+	}
+}
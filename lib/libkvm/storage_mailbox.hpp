@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace kvm
+{
+	/* The storage mailbox is a region of storage VM memory that request
+	   VMs access directly, as storage is mapped into them at the same
+	   addresses. Request VMs reserve buffers in it, and storage calls
+	   pass those buffers to storage by reference instead of copying them.
+	   Reservations are handed out from a ring of descriptors in order,
+	   and belong to their request VM until it is reset. */
+	class StorageMailbox {
+	public:
+		void init(uint64_t base, uint64_t size);
+		bool enabled() const noexcept { return m_size != 0; }
+		uint64_t base() const noexcept { return m_base; }
+		uint64_t size() const noexcept { return m_size; }
+
+		bool contains(uint64_t addr, uint64_t len) const noexcept {
+			return addr >= m_base && len <= m_size && addr - m_base <= m_size - len;
+		}
+		/* Reserve a buffer for the owner, returning its address, or 0
+		   when the ring has no room for it. */
+		uint64_t reserve(const void* owner, uint64_t len);
+		/* Release every reservation of the owner. */
+		void release(const void* owner);
+
+		struct Stats {
+			std::atomic<uint64_t> reservations {0};
+			std::atomic<uint64_t> full {0};
+			std::atomic<uint64_t> in_use {0}; /* Bytes */
+			std::atomic<uint64_t> max_in_use {0};
+			std::atomic<uint64_t> passed {0}; /* Input bytes passed by reference */
+			std::atomic<uint64_t> in_place {0}; /* Result bytes written in place */
+		} stats;
+
+	private:
+		struct Descriptor {
+			uint64_t offset;
+			uint64_t len;
+			const void* owner; /* nullptr once released */
+		};
+		std::mutex m_mtx;
+		std::deque<Descriptor> m_ring; /* Oldest first */
+		uint64_t m_base = 0;
+		uint64_t m_size = 0;
+		uint64_t m_head = 0; /* Offset of the next reservation */
+	};
+}
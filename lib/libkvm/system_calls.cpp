@@ -141,6 +141,21 @@ void MachineInstance::setup_syscall_interface()
 			case 0x1070A: // STOP_STORAGE TASK
 				syscall_stop_storage_task(cpu, inst);
 				return;
+			case 0x1070B: // STORAGE_ALLOW_READONLY
+				syscall_storage_allow_readonly(cpu, inst);
+				return;
+			case 0x1070C: // STORAGE CALL VECTOR WITH KEY
+				syscall_storage_callv_key(cpu, inst);
+				return;
+			case 0x1070D: // STORAGE_ALLOW_BATCH
+				syscall_storage_allow_batch(cpu, inst);
+				return;
+			case 0x1070E: // STORAGE_MAILBOX
+				syscall_storage_mailbox(cpu, inst);
+				return;
+			case 0x1070F: // STORAGE_TASK_RESULT
+				syscall_storage_task_result(cpu, inst);
+				return;
 			case 0x10710: // MULTIPROCESS
 				syscall_multiprocess(cpu, inst);
 				return;
@@ -153,6 +168,9 @@ void MachineInstance::setup_syscall_interface()
 			case 0x10713: // MULTIPROCESS_WAIT
 				syscall_multiprocess_wait(cpu, inst);
 				return;
+			case 0x10714: // STORAGE_TASK_HANDLE
+				syscall_storage_task_handle(cpu, inst);
+				return;
 			case 0x10A00: // GET_MEMINFO
 				syscall_memory_info(cpu, inst);
 				return;
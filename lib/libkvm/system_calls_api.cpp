@@ -134,6 +134,47 @@ static void syscall_storage_allow(vCPU& cpu, MachineInstance& inst)
 	cpu.set_registers(regs);
 }
 
+static void syscall_storage_allow_readonly(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	// Only from storage, and only during initialization
+	if (inst.is_storage() && inst.is_waiting_for_requests() == false) {
+		inst.program().storage().allow_list.insert(regs.rdi);
+		inst.program().storage().readonly_list.insert(regs.rdi);
+		regs.rax = 0;
+	} else {
+		regs.rax = -1;
+	}
+	cpu.set_registers(regs);
+}
+
+static void syscall_storage_allow_batch(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	// Only from storage, and only during initialization
+	if (inst.is_storage() && inst.is_waiting_for_requests() == false) {
+		inst.program().storage().batch_entry = regs.rdi;
+		regs.rax = 0;
+	} else {
+		regs.rax = -1;
+	}
+	cpu.set_registers(regs);
+}
+
+static void syscall_storage_mailbox(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	auto& prog = inst.program();
+	// Only from request VMs, which release their buffers when reset
+	if (!inst.is_storage() && &inst != prog.main_vm.get()
+		&& prog.has_storage() && prog.storage().mailbox.enabled()) {
+		regs.rax = prog.storage().mailbox.reserve(&inst, regs.rdi);
+	} else {
+		regs.rax = 0;
+	}
+	cpu.set_registers(regs);
+}
+
 static void syscall_storage_callv(vCPU& cpu, MachineInstance& inst)
 {
 	auto& regs = cpu.registers();
@@ -150,6 +191,22 @@ static void syscall_storage_callv(vCPU& cpu, MachineInstance& inst)
 	}
 	cpu.set_registers(regs);
 }
+static void syscall_storage_callv_key(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	const size_t n = regs.rdx;
+	if (!inst.is_storage() && n <= 64) {
+		VirtBuffer buffers[64];
+		cpu.machine().copy_from_guest(buffers, regs.rcx, n * sizeof(VirtBuffer));
+		regs.rax = inst.program().storage_call_key(cpu.machine(),
+		/*  key       func      buf vector    dst     dstsize */
+			regs.rdi, regs.rsi, n, buffers, regs.r8, regs.r9);
+	} else {
+		/* Prevent deadlock waiting for storage, while in storage. */
+		regs.rax = -1;
+	}
+	cpu.set_registers(regs);
+}
 static void syscall_storage_task(vCPU& cpu, MachineInstance& inst)
 {
 	auto& regs = cpu.registers();
@@ -163,8 +220,10 @@ static void syscall_storage_task(vCPU& cpu, MachineInstance& inst)
 		cpu.machine().buffer_to_string(argument, arglen, STORAGE_TASK_MAX_ARGUMENT);
 
 	if (start == 0 && period == 0) {
-		regs.rax = inst.program().storage_task(
+		/* Task ids are only returned by STORAGE_TASK_HANDLE */
+		const long id = inst.program().storage_task(
 			function, std::move(task_buffer));
+		regs.rax = (id < 0) ? -1 : 0;
 	} else {
 		/* XXX: Racy spam avoidance of async tasks. */
 		auto *prog = &inst.program();
@@ -188,12 +247,37 @@ static void syscall_storage_task(vCPU& cpu, MachineInstance& inst)
 	}
 	cpu.set_registers(regs);
 }
+static void syscall_storage_task_handle(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	const uint64_t function = regs.rdi;
+	const uint64_t argument = regs.rsi;
+	const size_t   arglen   = regs.rdx;
+
+	regs.rax = inst.program().storage_task(function,
+		cpu.machine().buffer_to_string(argument, arglen, STORAGE_TASK_MAX_ARGUMENT));
+	cpu.set_registers(regs);
+}
 static void syscall_stop_storage_task(vCPU& cpu, MachineInstance& inst)
 {
 	auto& regs = cpu.registers();
 	regs.rax = inst.program().m_timer_system.remove(regs.rdi);
 	cpu.set_registers(regs);
 }
+static void syscall_storage_task_result(vCPU& cpu, MachineInstance& inst)
+{
+	auto& regs = cpu.registers();
+	auto& prog = inst.program();
+	long result = 0;
+	if (prog.has_storage()) {
+		regs.rax = prog.storage().task_result(regs.rdi, result);
+	} else {
+		regs.rax = -2;
+	}
+	if (regs.rax == 1 && regs.rsi != 0)
+		cpu.machine().copy_to_guest(regs.rsi, &result, sizeof(result));
+	cpu.set_registers(regs);
+}
 
 static void syscall_multiprocess(vCPU& cpu, MachineInstance& inst)
 {
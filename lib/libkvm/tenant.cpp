@@ -53,11 +53,15 @@
  */
 #include "tenants.hpp"
 
+#include "budget.hpp"
 #include "common_defs.hpp"
 #include "curl_fetch.hpp"
+#include "shared_objects.hpp"
+#include "snapshot_cache.hpp"
 #include "tenant_instance.hpp"
 #include "utils/crc32.hpp"
 #include "varnish.hpp"
+#include <algorithm>
 #include <string_view>
 #include <thread>
 #include <nlohmann/json.hpp>
@@ -208,6 +212,62 @@ static void add_remapping(kvm::TenantGroup& group, const std::string& key, const
 	group.vmem_remappings.push_back(vmem);
 }
 
+static void validate_warmup_request(const kvm::TenantGroup::Warmup::Request& request)
+{
+	if (request.url.empty())
+		throw std::runtime_error("Warmup URL is empty");
+	if (request.method.empty())
+		throw std::runtime_error("Warmup method is empty");
+	for (const auto& header : request.headers) {
+		if (header.find(':') == std::string::npos)
+			throw std::runtime_error("Invalid header in warmup: " + header);
+	}
+}
+
+/* A warmup corpus has one JSON object per line, eg. captured with:
+   varnishncsa -j -F '{"method":"%m","url":"%U%q","headers":["Host: %{Host}i"]}' */
+static std::vector<kvm::TenantGroup::Warmup::Request> load_warmup_corpus(const std::string& filename)
+{
+	const auto file = kvm::file_loader(filename);
+	const std::string_view contents {(const char *)file.data(), file.size()};
+	std::vector<kvm::TenantGroup::Warmup::Request> requests;
+
+	size_t lineno = 0;
+	for (size_t pos = 0; pos < contents.size(); ) {
+		size_t end = contents.find('\n', pos);
+		if (end == std::string_view::npos)
+			end = contents.size();
+		const std::string_view line = contents.substr(pos, end - pos);
+		pos = end + 1;
+		lineno++;
+		if (line.find_first_not_of(" \t\r") == std::string_view::npos)
+			continue;
+		if (requests.size() >= kvm::WARMUP_CORPUS_MAX_REQUESTS)
+			throw std::runtime_error("Warmup corpus has too many requests: " + filename);
+
+		kvm::TenantGroup::Warmup::Request request;
+		try {
+			const auto j = json::parse(line.begin(), line.end());
+			request.method = j.value("method", "GET");
+			request.url = j.value("url", "/");
+			request.content_type = j.value("content_type", "");
+			request.body = j.value("body", "");
+			if (j.contains("headers")) {
+				for (const std::string header : j["headers"])
+					request.headers.push_back(header);
+			}
+			validate_warmup_request(request);
+		} catch (const std::exception& e) {
+			throw std::runtime_error("Warmup corpus " + filename + " line "
+				+ std::to_string(lineno) + ": " + e.what());
+		}
+		requests.push_back(std::move(request));
+	}
+	if (requests.empty())
+		throw std::runtime_error("Warmup corpus is empty: " + filename);
+	return requests;
+}
+
 template <typename It>
 static void configure_group(const std::string& name, kvm::TenantGroup& group, const It& obj)
 {
@@ -259,13 +319,163 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 	{
 		group.cold_start_snapshot_file = apply_dollar_vars(obj.value());
 	}
-	else if (obj.key() == "concurrency")
+	else if (obj.key() == "storage_snapshot_file")
+	{
+		// Snapshots of the storage VM, restored on the next start
+		group.storage_snapshot_file = apply_dollar_vars(obj.value());
+	}
+	else if (obj.key() == "storage_snapshot_interval_ms")
+	{
+		// Minimum time between snapshots of a storage VM in use
+		group.storage_snapshot_interval_ms = obj.value();
+	}
+	else if (obj.key() == "storage_readers")
+	{
+		// Forked views of storage for concurrent read-only storage calls
+		const unsigned readers = obj.value();
+		if (readers > STORAGE_MAX_READERS) {
+			throw std::runtime_error("Storage readers cannot be larger than "
+				+ std::to_string(STORAGE_MAX_READERS));
+		}
+		group.storage_readers = readers;
+	}
+	else if (obj.key() == "storage_shards")
+	{
+		// Independent storage VMs, selected by the key of keyed storage calls
+		const unsigned shards = obj.value();
+		if (shards < 1 || shards > STORAGE_MAX_SHARDS) {
+			throw std::runtime_error("Storage shards must be between 1 and "
+				+ std::to_string(STORAGE_MAX_SHARDS));
+		}
+		group.storage_shards = shards;
+	}
+	else if (obj.key() == "storage_batch")
+	{
+		// Storage calls that are waiting for storage are run together
+		const unsigned batch = obj.value();
+		if (batch > STORAGE_MAX_BATCH) {
+			throw std::runtime_error("Storage batch cannot be larger than "
+				+ std::to_string(STORAGE_MAX_BATCH));
+		}
+		group.storage_batch = batch;
+	}
+	else if (obj.key() == "storage_mailbox")
+	{
+		// Storage memory that requests pass buffers in by reference
+		group.storage_mailbox = uint64_t(obj.value()) * 1048576ul;
+	}
+	else if (obj.key() == "storage_task_queue")
+	{
+		// Storage tasks that may wait for storage at the same time
+		const unsigned depth = obj.value();
+		if (depth < 1 || depth > STORAGE_TASK_MAX_QUEUE) {
+			throw std::runtime_error("Storage task queue must be between 1 and "
+				+ std::to_string(STORAGE_TASK_MAX_QUEUE));
+		}
+		group.storage_task_queue = depth;
+	}
+	else if (obj.key() == "storage_task_overflow")
+	{
+		// What happens to storage tasks when the task queue is full
+		const auto mode = obj.value().template get<std::string>();
+		if (mode == "reject")
+			group.storage_task_coalesce = false;
+		else if (mode == "coalesce")
+			group.storage_task_coalesce = true;
+		else
+			throw std::runtime_error("Unknown storage task overflow mode: " + mode);
+	}
+	else if (obj.key() == "snapshot_cache")
+	{
+		// Restore from the automatic snapshot cache, if configured
+		group.snapshot_cache = obj.value();
+	}
+	else if (obj.key() == "cold_start_restore")
+	{
+		// What to read ahead when restoring a cold start snapshot
+		const auto mode = obj.value().template get<std::string>();
+		if (mode == "lazy")
+			group.cold_start_restore = ColdStartRestore::Lazy;
+		else if (mode == "hotset")
+			group.cold_start_restore = ColdStartRestore::HotSet;
+		else if (mode == "eager")
+			group.cold_start_restore = ColdStartRestore::Eager;
+		else
+			throw std::runtime_error("Unknown cold start restore mode: " + mode);
+	}
+	else if (obj.key() == "concurrency" || obj.key() == "max_concurrency")
 	{
 		group.max_concurrency = obj.value();
 		if (group.max_concurrency > 255) {
 			throw std::runtime_error("VM concurrency cannot be larger than 255");
 		}
 	}
+	else if (obj.key() == "min_concurrency")
+	{
+		// When lower than max_concurrency, the request VM pool starts
+		// with this many VMs and grows/shrinks with the measured queue wait.
+		group.min_concurrency = obj.value();
+		if (group.min_concurrency > 255) {
+			throw std::runtime_error("VM concurrency cannot be larger than 255");
+		}
+	}
+	else if (obj.key() == "scale_up_wait_ms")
+	{
+		// Grow the elastic pool when the average reservation wait is above this
+		group.scale_up_wait_ms = obj.value();
+	}
+	else if (obj.key() == "scale_down_idle_ms")
+	{
+		// Retire request VMs from the elastic pool after being idle this long
+		group.scale_down_idle_ms = obj.value();
+	}
+	else if (obj.key() == "scale_to_zero_ms")
+	{
+		// Retire all request VMs after the program has been idle this
+		// long. The next request forks them again.
+		group.scale_to_zero_ms = obj.value();
+	}
+	else if (obj.key() == "standby_vms")
+	{
+		// Keep this many request VMs reset and ready for new requests,
+		// by forking more VMs (up to max_concurrency) when too few are free
+		group.standby_vms = obj.value();
+		if (group.standby_vms > 255) {
+			throw std::runtime_error("Standby VMs cannot be larger than 255");
+		}
+	}
+	else if (obj.key() == "max_queue_wait_ms")
+	{
+		// Reject requests immediately when the estimated wait for a
+		// request VM is longer than this, instead of queueing them
+		group.max_queue_wait_ms = obj.value();
+	}
+	else if (obj.key() == "max_queue_waiters")
+	{
+		// Reject requests immediately when this many are already waiting
+		group.max_queue_waiters = obj.value();
+	}
+	else if (obj.key() == "shed_status")
+	{
+		// The response status of requests rejected by admission control
+		const unsigned status = obj.value();
+		if (status < 400 || status > 599) {
+			throw std::runtime_error("Shed status must be a 4xx or 5xx status code");
+		}
+		group.shed_status = status;
+	}
+	else if (obj.key() == "lifo_handoff")
+	{
+		// Hand out the most recently released request VM first, instead
+		// of the one that has been waiting the longest in the queue.
+		group.lifo_handoff = obj.value();
+	}
+	else if (obj.key() == "low_latency_handoff")
+	{
+		// Calls into request VMs spin briefly before sleeping, and
+		// bypass the thread pool queue. Costs some CPU when idle.
+		group.low_latency_handoff = obj.value();
+	}
 	else if (obj.key() == "storage")
 	{
 		group.has_storage = obj.value();
@@ -346,6 +556,18 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 		group.ephemeral = group.ephemeral || obj.value();
 		group.ephemeral_keep_working_memory = obj.value();
 	}
+	else if (obj.key() == "adaptive_working_memory")
+	{
+		// Tune the working memory kept after each reset per program,
+		// with limit_workmem_after_req (if set) as the upper bound
+		group.adaptive_working_memory = obj.value();
+	}
+	else if (obj.key() == "shared_library_cache")
+	{
+		// Open identical shared objects (eg. libc.so.6) through one path,
+		// so that all programs map the same page cache pages
+		group.shared_library_cache = obj.value();
+	}
 	else if (obj.key() == "mmap_backed_files")
 	{
 		group.mmap_backed_files = obj.value();
@@ -421,6 +643,9 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 				}
 				if (it.contains("writable")) {
 					path.writable = it["writable"].template get<bool>();
+					// Shared objects here must never replace others
+					if (path.writable)
+						SharedObjectCache::get().add_writable_path(path.real_path);
 				} else if (it.contains("symlink")) {
 					// A symlink must contain both a real and a virtual path
 					if (path.virtual_path.empty()) {
@@ -540,17 +765,30 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 			if (obj2.contains("exact")) {
 				group.warmup->exact = obj2["exact"];
 			}
-			if (obj2.contains("url")) {
-				group.warmup->url = obj2["url"];
-			}
-			if (obj2.contains("method")) {
-				group.warmup->method = obj2["method"];
+			if (obj2.contains("prefault")) {
+				group.warmup->prefault = obj2["prefault"];
 			}
-			if (obj2.contains("headers")) {
-				auto& headers = obj2["headers"];
-				for (const auto& header : headers) {
-					group.warmup->headers.insert(header);
+			if (obj2.contains("corpus")) {
+				// Recorded requests, replayed instead of a single URL
+				group.warmup->corpus = apply_dollar_vars(obj2["corpus"]);
+				group.warmup->requests = load_warmup_corpus(group.warmup->corpus);
+			} else {
+				TenantGroup::Warmup::Request request;
+				request.headers.push_back("User-Agent: tinykvm");
+				if (obj2.contains("url")) {
+					request.url = obj2["url"];
+				}
+				if (obj2.contains("method")) {
+					request.method = obj2["method"];
+				}
+				if (obj2.contains("headers")) {
+					for (const std::string header : obj2["headers"]) {
+						if (std::find(request.headers.begin(), request.headers.end(), header) == request.headers.end())
+							request.headers.push_back(header);
+					}
 				}
+				validate_warmup_request(request);
+				group.warmup->requests.push_back(std::move(request));
 			}
 		} else {
 			throw std::runtime_error("Warmup must be an object");
@@ -574,6 +812,69 @@ static void configure_group(const std::string& name, kvm::TenantGroup& group, co
 	}
 }
 
+/* Settings that depend on each other, once all of them are known,
+   ie. for programs, after overriding the settings of their group. */
+static void validate_group(const std::string& name, const kvm::TenantGroup& group)
+{
+	if (group.min_concurrency > group.max_concurrency) {
+		throw std::runtime_error("Minimum concurrency of '" + name
+			+ "' cannot be larger than its maximum concurrency");
+	}
+	if (group.standby_vms > group.max_concurrency) {
+		throw std::runtime_error("Standby VMs of '" + name
+			+ "' cannot be larger than its concurrency");
+	}
+	// Shards after the first run their calls without the read-only
+	// views and the snapshots of the storage VM, see: storage_call_key
+	if (group.storage_shards > 1
+		&& (group.storage_readers > 0 || !group.storage_snapshot_file.empty())) {
+		throw std::runtime_error("Storage shards of '" + name
+			+ "' cannot be combined with storage_readers or storage_snapshot_file");
+	}
+}
+
+/* The global budget is shared by all programs, across all groups. */
+template <typename T>
+static void configure_budget(const T& obj)
+{
+	uint64_t max_memory = 0;
+	uint64_t max_vms = 0;
+	for (auto it = obj.begin(); it != obj.end(); ++it) {
+		if (it.key() == "max_memory")
+			max_memory = uint64_t(it.value()) * 1048576ul;
+		else if (it.key() == "max_vms")
+			max_vms = it.value();
+		else
+			throw std::runtime_error("Unknown budget setting: " + it.key());
+	}
+	Budget::get().configure(max_memory, max_vms);
+}
+
+template <typename T>
+static void configure_snapshot_cache(const T& obj)
+{
+	std::string directory;
+	uint64_t max_size = 0;
+	for (auto it = obj.begin(); it != obj.end(); ++it) {
+		if (it.key() == "directory")
+			directory = apply_dollar_vars(it.value());
+		else if (it.key() == "max_size")
+			max_size = uint64_t(it.value()) * 1048576ul;
+		else
+			throw std::runtime_error("Unknown snapshot cache setting: " + it.key());
+	}
+	if (directory.empty())
+		throw std::runtime_error("The snapshot cache requires a directory");
+	SnapshotCache::get().configure(directory, max_size);
+}
+
+/* Top-level keys that configure the VMOD as a whole, and which can
+   therefore name neither a group nor a program. */
+static inline bool is_reserved(const std::string& key)
+{
+	return key == "budget" || key == "snapshot_cache";
+}
+
 /* This function is not strictly necessary - we are just trying to find the intention of
    the user. If any of these are present, we believe the intention of the user is to
    create a program definition. However, if group is missing, it is ultimately incomplete. */
@@ -613,7 +914,19 @@ static void init_tenants(VRT_CTX, VCL_PRIV task,
 	for (const auto& it : j.items())
 	{
 		const auto& obj = it.value();
+		if (is_reserved(it.key()) && is_tenant(obj)) {
+			throw std::runtime_error("'" + it.key()
+				+ "' is a reserved name, and cannot be used for a program");
+		}
 		if (is_tenant(obj)) continue;
+		if (it.key() == "budget") {
+			configure_budget(obj);
+			continue;
+		}
+		if (it.key() == "snapshot_cache") {
+			configure_snapshot_cache(obj);
+			continue;
+		}
 
 		const auto& grname = it.key();
 		auto grit = groups.find(grname);
@@ -640,6 +953,10 @@ static void init_tenants(VRT_CTX, VCL_PRIV task,
 		{
 			const std::string grname =
 				!obj.contains("group") ? "test" : obj["group"];
+			if (UNLIKELY(is_reserved(grname))) {
+				throw std::runtime_error("'" + grname
+					+ "' is a reserved name, and cannot be used for a group");
+			}
 			auto grit = groups.find(grname);
 			if (UNLIKELY(grit == groups.end())) {
 				throw std::runtime_error("Could not find group " + grname + " for '" + it.key() + "'");
@@ -651,6 +968,7 @@ static void init_tenants(VRT_CTX, VCL_PRIV task,
 			for (auto it = obj.begin(); it != obj.end(); ++it) {
 				configure_group(grname, group, it);
 			}
+			validate_group(it.key(), group);
 
 			/* Filenames are optional. */
 			std::string filename = "";
@@ -848,6 +1166,7 @@ int kvm_tenant_configure(VRT_CTX, kvm::TenantInstance* ten, const char* str)
 		for (auto it = j.begin(); it != j.end(); ++it) {
 			kvm::configure_group(ten->config.name, ten->config.group, it);
 		}
+		kvm::validate_group(ten->config.name, ten->config.group);
 		return 1;
 	} catch (const std::exception& e) {
 		VSL(SLT_Error, 0,
@@ -4,8 +4,8 @@
 #include <map>
 #include <memory>
 #include <string>
-#include <unordered_set>
 #include <vector>
+#include "cold_start.hpp"
 #include "settings.hpp"
 #include <tinykvm/common.hpp>
 namespace tinykvm {
@@ -28,12 +28,22 @@ struct TenantGroup {
 	uint64_t hugepage_arena_size = 0; /* Megabytes */
 	uint64_t hugepage_requests_arena = 0; /* Megabytes */
 	size_t   max_concurrency = 2; /* Request VMs */
+	size_t   min_concurrency = 0; /* Elastic pool floor, 0: Fixed-size pool */
+	uint32_t scale_up_wait_ms = POOL_SCALE_UP_WAIT_MS; /* Average reservation wait */
+	uint32_t scale_down_idle_ms = POOL_SCALE_DOWN_IDLE_MS; /* Idle time before retiring a VM */
+	uint32_t scale_to_zero_ms = 0; /* Idle time before retiring all VMs, 0: Disabled */
+	size_t   standby_vms = 0; /* Free, already reset VMs to keep ready, 0: Disabled */
+	uint32_t max_queue_wait_ms = 0; /* Shed requests with a longer estimated wait, 0: Disabled */
+	uint32_t max_queue_waiters = 0; /* Shed requests when this many are waiting, 0: Disabled */
+	uint16_t shed_status = ADMISSION_SHED_STATUS; /* Response status of shed requests */
 	size_t   max_smp         = 0; /* Multi-processing per VM */
 	size_t   max_regex    = 64;
 	bool     has_storage  = false;
 	bool     hugepages    = false;
 	bool     split_hugepages = true;
 	bool     transparent_hugepages = false;
+	bool     lifo_handoff = false; /* Reuse the most recently released VM */
+	bool     low_latency_handoff = false; /* Spin-then-futex calls into request VMs */
 	bool     allow_debug = false;
 	bool     remote_debug_on_exception = false;
 	bool     mmap_backed_files = true;
@@ -41,21 +51,40 @@ struct TenantGroup {
 	bool     control_ephemeral = false;
 	bool     ephemeral = true;
 	bool     ephemeral_keep_working_memory = true;
+	bool     adaptive_working_memory = false; /* Tune limit_req_mem per program */
+	bool     shared_library_cache = false; /* Open identical shared objects from one path */
 	bool     print_stdout = false; /* Print directly to stdout */
 	bool     verbose = false;
 	bool     verbose_syscalls = false;
 	bool     verbose_pagetable = false;
 	std::string cold_start_snapshot_file; /* Path to cold start snapshot file */
+	ColdStartRestore cold_start_restore = ColdStartRestore::Lazy;
+	bool     snapshot_cache = true; /* Use the snapshot cache, when configured */
+	std::string storage_snapshot_file; /* Path to storage VM snapshot file */
+	uint32_t storage_snapshot_interval_ms = STORAGE_SNAPSHOT_INTERVAL_MS; /* 0: Only at start and exit */
+	uint16_t storage_readers = 0; /* Views of storage for read-only calls */
+	uint16_t storage_shards = 1; /* Storage VMs that keyed calls are spread across */
+	uint16_t storage_batch = 0; /* Storage calls run together, 0: No batching */
+	uint64_t storage_mailbox = 0; /* Bytes of storage memory shared with requests */
+	uint16_t storage_task_queue = STORAGE_TASK_QUEUE_DEPTH; /* Storage tasks waiting for storage */
+	bool     storage_task_coalesce = false; /* Coalesce instead of rejecting tasks when full */
 
 	/* Warmup the VM before starting 'real' request handling. */
 	struct Warmup {
 		uint16_t num_requests = 0;
 		bool exact = false; /* Use exact number of requests, otherwise heuristic */
-		std::string url = "/";
-		std::string method = "GET";
-		std::unordered_set<std::string> headers {
-			"User-Agent: tinykvm"
+		bool prefault = false; /* Run a warmup pass in each forked VM */
+		struct Request {
+			std::string method = "GET";
+			std::string url = "/";
+			std::string content_type;
+			std::string body; /* Empty: No POST data */
+			std::vector<std::string> headers;
 		};
+		/* Replayed round-robin. Either the single request given by url,
+		   method and headers, or the requests of a corpus file. */
+		std::vector<Request> requests;
+		std::string corpus; /* Path to the corpus file, if any */
 	};
 	std::shared_ptr<Warmup> warmup = nullptr;
 	/* When port is non-zero, start an epoll server to receive non-HTTP
@@ -110,6 +139,14 @@ struct TenantGroup {
 		return (this->server_port != 0 || !this->server_address.empty()) &&
 		       this->epoll_systems > 0;
 	}
+	/* An elastic pool starts out with min_concurrency request VMs,
+	   and grows towards max_concurrency when requests are queueing. */
+	bool is_elastic() const noexcept {
+		return this->min_concurrency > 0 && this->min_concurrency < this->max_concurrency;
+	}
+	size_t initial_concurrency() const noexcept {
+		return is_elastic() ? this->min_concurrency : this->max_concurrency;
+	}
 	bool has_websocket_system() const noexcept {
 		return (this->ws_server_port != 0 || !this->ws_server_address.empty()) &&
 		       this->websocket_systems > 0;
@@ -29,6 +29,11 @@ namespace kvm {
 extern std::vector<uint8_t> file_loader(const std::string&);
 extern std::string create_sha256_from_file(const std::string&);
 extern std::string create_md5_from_file(const std::string&);
+/* Admission control outcome of the last reservation on this thread. */
+static thread_local struct {
+	uint16_t status;
+	uint32_t retry_after;
+} last_shed {0, 0};
 
 TenantInstance::TenantInstance(const TenantConfig& conf)
 	: config{conf}
@@ -107,7 +112,7 @@ void TenantInstance::begin_initialize(VRT_CTX, bool debug)
 				VTIM_format(st.st_mtim.tv_sec, buf);
 				filename_mtime = "If-Modified-Since: " + std::string(buf);
 			}
-			auto prog = std::make_shared<ProgramInstance> (
+			auto prog = ProgramInstance::make(
 				config.uri, std::move(filename_mtime), ctx, this, debug);
 			std::atomic_store(&this->program, std::move(prog));
 		} catch (const std::exception& e) {
@@ -151,7 +156,7 @@ void TenantInstance::begin_initialize(VRT_CTX, bool debug)
 			storage_elf.set_binary(config.storage_program_filename());
 		}
 		std::shared_ptr<ProgramInstance> prog =
-			std::make_shared<ProgramInstance> (std::move(elf), std::move(storage_elf), ctx, this);
+			ProgramInstance::make(std::move(elf), std::move(storage_elf), ctx, this);
 		std::atomic_store(&this->program, std::move(prog));
 
 	} catch (const std::exception& e) {
@@ -198,7 +203,7 @@ std::shared_ptr<ProgramInstance> TenantInstance::wait_for_initialization()
 	return prog;
 }
 
-VMPoolItem* TenantInstance::vmreserve(const vrt_ctx* ctx, bool debug)
+VMPoolItem* TenantInstance::vmreserve(const vrt_ctx* ctx, bool debug, unsigned priority)
 {
 	// Priv-task have request lifetime and is a Varnish feature.
 	// The key identifies any existing priv_task objects, which allows
@@ -214,6 +219,7 @@ VMPoolItem* TenantInstance::vmreserve(const vrt_ctx* ctx, bool debug)
 	}
 	if (!priv_task->priv)
 	{
+		last_shed = {0, 0};
 	#ifdef ENABLE_TIMING
 		TIMING_LOCATION(t0);
 	#endif
@@ -225,7 +231,7 @@ VMPoolItem* TenantInstance::vmreserve(const vrt_ctx* ctx, bool debug)
 
 			// Reserve a machine through blocking queue.
 			// May throw if dequeue from the queue times out.
-			Reservation resv = prog->reserve_vm(ctx, this, std::move(prog));
+			Reservation resv = prog->reserve_vm(ctx, this, std::move(prog), false, priority);
 			// prog is nullptr after this ^
 
 			priv_task->priv = resv.slot;
@@ -243,6 +249,11 @@ VMPoolItem* TenantInstance::vmreserve(const vrt_ctx* ctx, bool debug)
 			ptm->fini  = resv.free;
 			priv_task->methods = ptm;
 #endif
+		} catch (const AdmissionRejected& ar) {
+			last_shed = {ar.status, ar.retry_after};
+			VSLb(ctx->vsl, SLT_Error,
+				"VM '%s' exception: %s", config.name.c_str(), ar.what());
+			return nullptr;
 		} catch (std::exception& e) {
 			// It makes no sense to reserve a VM without a request w/VSL
 			VSLb(ctx->vsl, SLT_Error,
@@ -263,8 +274,9 @@ VMPoolItem* TenantInstance::vmreserve(const vrt_ctx* ctx, bool debug)
 	return (VMPoolItem*) priv_task->priv;
 }
 
-VMPoolItem* TenantInstance::temporary_vmreserve(const vrt_ctx* ctx, bool debug, bool soft_reset)
+VMPoolItem* TenantInstance::temporary_vmreserve(const vrt_ctx* ctx, bool debug, bool soft_reset, unsigned priority)
 {
+	last_shed = {0, 0};
 	try
 	{
 		auto prog = this->ref(ctx, debug);
@@ -273,11 +285,16 @@ VMPoolItem* TenantInstance::temporary_vmreserve(const vrt_ctx* ctx, bool debug,
 
 		// Reserve a machine through blocking queue.
 		// May throw if dequeue from the queue times out.
-		auto resv = prog->reserve_vm(ctx, this, std::move(prog), soft_reset);
+		auto resv = prog->reserve_vm(ctx, this, std::move(prog), soft_reset, priority);
 		// prog is nullptr after this ^
 
 		return resv.slot;
 
+	} catch (const AdmissionRejected& ar) {
+		last_shed = {ar.status, ar.retry_after};
+		VSLb(ctx->vsl, SLT_Error,
+			"VM '%s' exception: %s", config.name.c_str(), ar.what());
+		return nullptr;
 	} catch (std::exception& e) {
 		// It makes no sense to reserve a VM without a request w/VSL
 		VSLb(ctx->vsl, SLT_Error,
@@ -285,6 +302,11 @@ VMPoolItem* TenantInstance::temporary_vmreserve(const vrt_ctx* ctx, bool debug,
 		return nullptr;
 	}
 }
+uint16_t TenantInstance::last_shed_status(uint32_t& retry_after) noexcept
+{
+	retry_after = last_shed.retry_after;
+	return last_shed.status;
+}
 void TenantInstance::temporary_vmreserve_free(const vrt_ctx* ctx, void* slotv)
 {
 	VMPoolItem *slot = (VMPoolItem *)slotv;
@@ -2,6 +2,7 @@
 #include <functional>
 #include <memory>
 #include <mutex>
+#include "settings.hpp"
 #include "tenant.hpp"
 struct vrt_ctx;
 namespace tinykvm { struct vCPU; }
@@ -13,9 +14,12 @@ struct VMPoolItem;
 
 class TenantInstance {
 public:
-	VMPoolItem* vmreserve(const vrt_ctx*, bool debug);
-	VMPoolItem* temporary_vmreserve(const vrt_ctx*, bool debug, bool soft_reset);
+	VMPoolItem* vmreserve(const vrt_ctx*, bool debug, unsigned priority = PRIORITY_DEFAULT);
+	VMPoolItem* temporary_vmreserve(const vrt_ctx*, bool debug, bool soft_reset, unsigned priority = PRIORITY_DEFAULT);
 	static void temporary_vmreserve_free(const vrt_ctx*, void* reservation);
+	/* Status and Retry-After seconds when the last reservation on
+	   this thread was shed by admission control, otherwise zero. */
+	static uint16_t last_shed_status(uint32_t& retry_after) noexcept;
 
 	std::shared_ptr<ProgramInstance> ref(const vrt_ctx *, bool debug);
 	bool no_program_loaded() const noexcept { return this->program == nullptr; }
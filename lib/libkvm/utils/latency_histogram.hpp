@@ -0,0 +1,117 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <time.h>
+
+namespace kvm
+{
+	/* Threads are spread round-robin over histogram shards. */
+	inline unsigned latency_histogram_shard() noexcept
+	{
+		static std::atomic<unsigned> next_shard {0};
+		static thread_local const unsigned shard = next_shard.fetch_add(1);
+		return shard;
+	}
+
+	/* A lock-free log-linear (HDR-style) histogram of latencies in
+	   nanoseconds. Each power of two is divided into 8 sub-buckets,
+	   which bounds the relative error to 12.5%. Recording threads are
+	   spread over shards so that they rarely share cache lines, and
+	   the shards are merged when the histogram is read. */
+	template <unsigned SHARDS>
+	struct LatencyHistogram {
+		static constexpr unsigned SUB_BITS = 3;
+		static constexpr unsigned SUB_BUCKETS = 1u << SUB_BITS;
+		static constexpr unsigned MAX_EXPONENT = 36; /* ~68 seconds */
+		static constexpr unsigned BUCKETS = (MAX_EXPONENT - SUB_BITS + 1) * SUB_BUCKETS;
+
+		struct Snapshot {
+			std::array<uint64_t, BUCKETS> counts {};
+			uint64_t samples = 0;
+
+			/* Returns the highest value in the bucket containing
+			   the given percentile (0.0 - 1.0), or 0 when empty. */
+			uint64_t percentile(double p) const noexcept
+			{
+				if (samples == 0)
+					return 0;
+				uint64_t target = p * samples;
+				if (target < samples) target++;
+				uint64_t sum = 0;
+				for (unsigned idx = 0; idx < BUCKETS; idx++) {
+					sum += counts[idx];
+					if (sum >= target)
+						return highest_value(idx);
+				}
+				return highest_value(BUCKETS - 1);
+			}
+		};
+
+		void record(uint64_t ns) noexcept
+		{
+			auto& shard = m_shards[latency_histogram_shard() % SHARDS];
+			shard.counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		}
+		/* Merge all shards. Racy, but each bucket is consistent. */
+		Snapshot snapshot() const noexcept
+		{
+			Snapshot snap;
+			for (const auto& shard : m_shards) {
+				for (unsigned idx = 0; idx < BUCKETS; idx++) {
+					const uint64_t count =
+						shard.counts[idx].load(std::memory_order_relaxed);
+					snap.counts[idx] += count;
+					snap.samples += count;
+				}
+			}
+			return snap;
+		}
+
+		static unsigned bucket(uint64_t value) noexcept
+		{
+			if (value < SUB_BUCKETS)
+				return value;
+			const unsigned exp = 63 - __builtin_clzll(value);
+			if (exp >= MAX_EXPONENT)
+				return BUCKETS - 1;
+			return (exp - SUB_BITS + 1) * SUB_BUCKETS
+				+ ((value >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1));
+		}
+		static uint64_t highest_value(unsigned idx) noexcept
+		{
+			if (idx < SUB_BUCKETS)
+				return idx;
+			const unsigned shift = idx / SUB_BUCKETS - 1;
+			const uint64_t sub = idx % SUB_BUCKETS;
+			return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+		}
+
+	private:
+		struct alignas(64) Shard {
+			std::array<std::atomic<uint64_t>, BUCKETS> counts {};
+		};
+		std::array<Shard, SHARDS> m_shards {};
+	};
+
+	/* Records the wall-time of a scope into a histogram. */
+	template <typename Histogram>
+	struct ScopedLatency {
+		ScopedLatency(Histogram& histogram)
+			: m_histogram(histogram), t0(now())  {}
+		~ScopedLatency() {
+			m_histogram.record(now() - t0);
+		}
+
+		static inline uint64_t now() noexcept {
+			struct timespec ts;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+		}
+
+	private:
+		Histogram& m_histogram;
+		const uint64_t t0;
+	};
+} // kvm
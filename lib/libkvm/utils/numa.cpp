@@ -0,0 +1,147 @@
+#include "numa.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+static constexpr int KVM_MPOL_PREFERRED = 1; /* From <numaif.h> */
+
+namespace kvm
+{
+	const NumaTopology& NumaTopology::get()
+	{
+		static const NumaTopology topology;
+		return topology;
+	}
+
+	NumaTopology::NumaTopology()
+	{
+		const char* fake = getenv("KVM_NUMA_TOPOLOGY");
+		if (fake == nullptr || !load_fake(fake))
+			load_sysfs();
+		/* Always have at least one node containing every CPU. */
+		if (nodes.empty())
+			nodes.push_back(Node{0, {}});
+
+		for (size_t idx = 0; idx < nodes.size(); idx++) {
+			for (const int cpu : nodes[idx].cpus) {
+				if (cpu < 0 || cpu >= 4096)
+					continue;
+				if ((size_t)cpu >= m_cpu_node.size())
+					m_cpu_node.resize(cpu + 1, 0xFF);
+				/* The first node listing a CPU owns it. */
+				if (m_cpu_node[cpu] == 0xFF)
+					m_cpu_node[cpu] = idx;
+			}
+		}
+		for (auto& node : m_cpu_node)
+			if (node == 0xFF) node = 0;
+	}
+
+	bool NumaTopology::load_fake(const char* filename)
+	{
+		std::ifstream file(filename);
+		if (!file.is_open()) {
+			fprintf(stderr, "kvm: Could not open NUMA topology file '%s'\n", filename);
+			return false;
+		}
+		std::string line;
+		while (std::getline(file, line)) {
+			if (line.empty() || line[0] == '#')
+				continue;
+			std::istringstream ss(line);
+			Node node;
+			std::string cpulist;
+			if (ss >> node.id >> cpulist) {
+				node.cpus = parse_cpulist(cpulist);
+				nodes.push_back(std::move(node));
+			}
+		}
+		return !nodes.empty();
+	}
+
+	void NumaTopology::load_sysfs()
+	{
+		DIR* dir = opendir("/sys/devices/system/node");
+		if (dir == nullptr)
+			return;
+		while (struct dirent* ent = readdir(dir)) {
+			int id = 0;
+			if (sscanf(ent->d_name, "node%d", &id) != 1)
+				continue;
+			std::ifstream file("/sys/devices/system/node/" + std::string(ent->d_name) + "/cpulist");
+			std::string cpulist;
+			if (!std::getline(file, cpulist))
+				continue;
+			auto cpus = parse_cpulist(cpulist);
+			/* Memory-only nodes have no CPUs to run VMs on. */
+			if (!cpus.empty())
+				nodes.push_back(Node{id, std::move(cpus)});
+		}
+		closedir(dir);
+		std::sort(nodes.begin(), nodes.end(),
+			[] (const Node& a, const Node& b) { return a.id < b.id; });
+	}
+
+	std::vector<int> NumaTopology::parse_cpulist(const std::string& list)
+	{
+		/* Example: 0-3,8-11,16 */
+		std::vector<int> cpus;
+		std::istringstream ss(list);
+		std::string range;
+		while (std::getline(ss, range, ',')) {
+			int first = 0, last = 0;
+			const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+			if (n == 1)
+				last = first;
+			else if (n != 2)
+				continue;
+			for (int cpu = first; cpu <= last && cpu < 4096; cpu++)
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+
+	unsigned NumaTopology::current_node() const noexcept
+	{
+#ifdef __x86_64__
+		/* Linux stores the CPU number in the low 12 bits of TSC_AUX. */
+		unsigned long a,d,c;
+		__asm__ volatile("rdtscp" : "=a" (a), "=d" (d), "=c" (c));
+		const unsigned cpu = c & 0xFFF;
+#else
+		const unsigned cpu = sched_getcpu();
+#endif
+		return (cpu < m_cpu_node.size()) ? m_cpu_node[cpu] : 0;
+	}
+
+	bool NumaTopology::bind_thread(unsigned idx) const
+	{
+		if (idx >= nodes.size())
+			return false;
+		const auto& node = nodes[idx];
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (const int cpu : node.cpus)
+			CPU_SET(cpu, &set);
+		const bool affinity =
+			sched_setaffinity(0, sizeof(set), &set) == 0;
+
+		/* Prefer allocating from the node, falling back to other nodes. */
+		unsigned long nodemask[64 / sizeof(unsigned long)] {};
+		if (node.id < 0 || node.id >= 512)
+			return false;
+		nodemask[node.id / (8 * sizeof(unsigned long))] |=
+			1UL << (node.id % (8 * sizeof(unsigned long)));
+		const bool mempolicy = syscall(SYS_set_mempolicy,
+			KVM_MPOL_PREFERRED, nodemask, 512 + 1) == 0;
+
+		return affinity && mempolicy;
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace kvm
+{
+	/* The NUMA topology of the machine, read once from sysfs. Node
+	   numbers are compacted into indices 0..N-1. A fake topology can
+	   be provided with the KVM_NUMA_TOPOLOGY environment variable,
+	   pointing to a file with one "<node> <cpulist>" line per node. */
+	struct NumaTopology {
+		struct Node {
+			int id;
+			std::vector<int> cpus;
+		};
+		std::vector<Node> nodes;
+
+		static const NumaTopology& get();
+
+		size_t num_nodes() const noexcept { return nodes.size(); }
+		/* Node index of the CPU the calling thread is running on. */
+		unsigned current_node() const noexcept;
+		/* Bind the calling thread, and memory it allocates from now
+		   on, to the given node index. Returns false on failure. */
+		bool bind_thread(unsigned node) const;
+
+		static std::vector<int> parse_cpulist(const std::string&);
+
+	private:
+		NumaTopology();
+		bool load_fake(const char* filename);
+		void load_sysfs();
+		std::vector<uint8_t> m_cpu_node;
+	};
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <condition_variable>
+#include <mutex>
+
+namespace kvm
+{
+	/* A reader/writer gate. Any number of readers may hold the gate
+	   together, while a writer holds it alone. Waiting writers hold
+	   back new readers, so that a steady stream of readers can not
+	   starve them. Usable with std::shared_lock and std::unique_lock. */
+	class RWGate {
+	public:
+		void lock_shared()
+		{
+			std::unique_lock lock(m_mtx);
+			m_cond.wait(lock, [this] {
+				return !m_writer && m_writers_waiting == 0;
+			});
+			m_readers++;
+		}
+		void unlock_shared()
+		{
+			std::unique_lock lock(m_mtx);
+			if (--m_readers == 0 && m_writers_waiting > 0) {
+				lock.unlock();
+				m_cond.notify_all();
+			}
+		}
+		void lock()
+		{
+			std::unique_lock lock(m_mtx);
+			m_writers_waiting++;
+			m_cond.wait(lock, [this] {
+				return !m_writer && m_readers == 0;
+			});
+			m_writers_waiting--;
+			m_writer = true;
+		}
+		void unlock()
+		{
+			{
+				std::scoped_lock lock(m_mtx);
+				m_writer = false;
+			}
+			m_cond.notify_all();
+		}
+
+	private:
+		std::mutex m_mtx;
+		std::condition_variable m_cond;
+		unsigned m_readers = 0;
+		unsigned m_writers_waiting = 0;
+		bool m_writer = false;
+	};
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace kvm
+{
+	/* A single-producer single-consumer call slot between a request
+	   thread (producer) and a VM thread (consumer). Both sides may spin
+	   for a bounded number of iterations before sleeping on a futex,
+	   and nothing is allocated per call: The callable lives on the
+	   stack of the waiting producer, and the completion is the slot
+	   itself. Only one producer may use the slot at a time, which is
+	   guaranteed by VM reservation. */
+	template <unsigned SPIN>
+	struct VMHandoff {
+		using callback_t = long(*)(void*);
+
+		/* Run func(arg) on the consumer thread and wait for the result.
+		   Exceptions thrown by func are re-thrown here. */
+		long call(callback_t func, void* arg)
+		{
+			submit(func, arg, false);
+			wait_until(DONE, m_producer_waiting);
+			const long result = m_result;
+			std::exception_ptr exception = std::move(m_exception);
+			m_exception = nullptr;
+			m_state.store(IDLE);
+			if (__builtin_expect(exception != nullptr, 0))
+				std::rethrow_exception(exception);
+			return result;
+		}
+		/* Run func(arg) on the consumer thread without waiting for it.
+		   The argument must outlive the call. Exceptions are dropped. */
+		void post(callback_t func, void* arg)
+		{
+			submit(func, arg, true);
+		}
+		/* Make the consumer loop return. When called from inside
+		   a callback, the loop returns after the callback. */
+		void stop()
+		{
+			if (std::this_thread::get_id() == m_consumer) {
+				m_stop = true;
+				return;
+			}
+			submit(nullptr, nullptr, true);
+		}
+		bool on_consumer_thread() const noexcept {
+			return std::this_thread::get_id() == m_consumer;
+		}
+		/* Without spinning, both sides go straight to sleep. Only
+		   set while the consumer loop is not running. */
+		void set_spinning(bool spin) noexcept {
+			m_spin = (spin && std::thread::hardware_concurrency() > 1) ? SPIN : 0;
+		}
+
+		/* The consumer loop, running until stop() is called. It may be
+		   run again after it has stopped. */
+		void run()
+		{
+			m_stop = false;
+			m_consumer = std::this_thread::get_id();
+			while (!m_stop) {
+				wait_until(REQUEST, m_consumer_waiting);
+				const callback_t func = m_func;
+				if (func == nullptr) {
+					m_consumer = std::thread::id{};
+					set_state(IDLE, m_producer_waiting);
+					return;
+				}
+				if (m_detached) {
+					try {
+						func(m_arg);
+					} catch (...) {}
+					set_state(IDLE, m_producer_waiting);
+				} else {
+					try {
+						m_result = func(m_arg);
+					} catch (...) {
+						m_exception = std::current_exception();
+					}
+					set_state(DONE, m_producer_waiting);
+				}
+			}
+			m_consumer = std::thread::id{};
+		}
+
+	private:
+		enum : uint32_t { IDLE, REQUEST, DONE };
+
+		void submit(callback_t func, void* arg, bool detached)
+		{
+			/* A detached call may still be running. */
+			wait_until(IDLE, m_producer_waiting);
+			m_func = func;
+			m_arg  = arg;
+			m_detached = detached;
+			set_state(REQUEST, m_consumer_waiting);
+		}
+		void set_state(uint32_t state, std::atomic<uint32_t>& waiting)
+		{
+			m_state.store(state);
+			/* Only enter the kernel when the other side is asleep. */
+			if (waiting.load() != 0)
+				syscall(SYS_futex, &m_state, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+		}
+		void wait_until(uint32_t state, std::atomic<uint32_t>& waiting)
+		{
+			for (unsigned i = 0; i < m_spin; i++) {
+				if (m_state.load(std::memory_order_acquire) == state)
+					return;
+#ifdef __x86_64__
+				__builtin_ia32_pause();
+#endif
+			}
+			/* Announce that we are sleeping, then re-check the state. */
+			waiting.store(1);
+			uint32_t current;
+			while ((current = m_state.load()) != state) {
+				syscall(SYS_futex, &m_state, FUTEX_WAIT_PRIVATE, current, nullptr, nullptr, 0);
+			}
+			waiting.store(0);
+		}
+
+		/* Spinning on a single CPU only delays the other side. */
+		unsigned m_spin = (std::thread::hardware_concurrency() > 1) ? SPIN : 0;
+		std::atomic<uint32_t> m_state {IDLE};
+		std::atomic<uint32_t> m_producer_waiting {0};
+		std::atomic<uint32_t> m_consumer_waiting {0};
+		callback_t m_func = nullptr;
+		void* m_arg = nullptr;
+		bool  m_detached = false;
+		bool  m_stop = false;
+		std::atomic<std::thread::id> m_consumer {};
+		long  m_result = 0;
+		std::exception_ptr m_exception = nullptr;
+	};
+}
@@ -50,6 +50,24 @@ struct kvm_program_chain* kvm_chain_get_queue()
 	return &kqueue;
 }
 
+/* Parse a VCL priority class. Returns -1 when invalid. */
+int kvm_parse_priority(const char *priority)
+{
+	if (priority == NULL || priority[0] == 0 || strcmp(priority, "default") == 0)
+		return (KVM_PRIO_DEFAULT);
+	if (strcmp(priority, "interactive") == 0)
+		return (KVM_PRIO_INTERACTIVE);
+	if (strcmp(priority, "background") == 0)
+		return (KVM_PRIO_BACKGROUND);
+	return (-1);
+}
+/* The whole chain shares the priority of the request. */
+void kvm_chain_set_priority(struct kvm_program_chain *chain, int priority)
+{
+	for (int i = 0; i < chain->count; i++)
+		chain->chain[i].priority = priority;
+}
+
 static inline struct vmod_priv *
 kvm_get_priv_task(VRT_CTX)
 {
@@ -415,15 +433,33 @@ kvmbe_gethdrs(const struct vrt_ctx *other_ctx, const struct director *dir)
 			}
 		} else if (is_temporary) {
 			/* This is in the middle of a chain, temporary reservation. */
-			slot = kvm_temporarily_reserve_machine(&ctx, invocation->tenant, kvmr->debug, false);
+			slot = kvm_temporarily_reserve_machine(&ctx, invocation->tenant, kvmr->debug, false,
+				invocation->priority);
 		} else {
 			/* The last in the chain is a full reservation. */
-			slot = kvm_reserve_machine(&ctx, invocation->tenant, kvmr->debug);
+			slot = kvm_reserve_machine(&ctx, invocation->tenant, kvmr->debug,
+				invocation->priority);
 		}
 		if (slot == NULL) {
 			/* Let go of any previous program in the chain. */
 			LOOP_EXIT_ACTIONS();
 
+			/* Overloaded programs reject requests early, and tell
+			   the client when to come back. */
+			unsigned retry_after = 0;
+			const int shed_status = kvm_reservation_shed(&retry_after);
+			if (shed_status > 0) {
+				VSLb(ctx.vsl, SLT_Error,
+					"KVM: Request shed for index %d, program %s",
+					index, kvm_tenant_name(invocation->tenant));
+				http_Unset(bo->beresp, H_Content_Type);
+				http_PrintfHeader(bo->beresp, "Retry-After: %u", retry_after);
+				result->status = shed_status;
+				result->content_length = 0;
+				result->bufcount = 0;
+				return (kvmbe_write_response(bo, &ctx, result));
+			}
+
 			VSLb(ctx.vsl, SLT_Error,
 				"KVM: Unable to reserve VM for index %d, program %s",
 				index, kvm_tenant_name(invocation->tenant));
@@ -625,6 +661,7 @@ kvm_init_chain(VRT_CTX, struct vmod_kvm_tenant *tenant, const char *url, const c
 	item->inputs.argument = arg ? arg : "";
 	item->break_status = 1000; /* No breaking for last program. */
 	item->soft_reset = 0;
+	item->priority = KVM_PRIO_DEFAULT;
 
 	if (kqueue->count == 0) {
 		struct http *hp;
@@ -661,6 +698,7 @@ kvm_init_fetch(VRT_CTX, const char *url, const char *arg)
 	item->inputs.argument = arg ? arg : "";
 	item->inputs.method = "";
 	item->inputs.content_type = "";
+	item->priority = KVM_PRIO_DEFAULT;
 
 	kqueue->count++;
 	return (item);
@@ -673,8 +711,8 @@ static void init_kvmr(struct vmod_kvm_backend *kvmr)
 	kqueue.count = 0;
 }
 
-VCL_BACKEND vmod_vm_backend(VRT_CTX, VCL_PRIV task,
-	VCL_STRING program, VCL_STRING url, VCL_STRING arg)
+VCL_BACKEND kvm_vm_backend(VRT_CTX, VCL_PRIV task,
+	VCL_STRING program, VCL_STRING url, VCL_STRING arg, int priority)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	AN(task);
@@ -707,6 +745,7 @@ VCL_BACKEND vmod_vm_backend(VRT_CTX, VCL_PRIV task,
 	if (!kvm_init_chain(ctx, tenant, url, arg)) {
 		return (NULL);
 	}
+	kvm_chain_set_priority(&kqueue, priority);
 
 	init_kvmr(kvmr);
 
@@ -714,6 +753,12 @@ VCL_BACKEND vmod_vm_backend(VRT_CTX, VCL_PRIV task,
 	return (kvmr->dir);
 }
 
+VCL_BACKEND vmod_vm_backend(VRT_CTX, VCL_PRIV task,
+	VCL_STRING program, VCL_STRING url, VCL_STRING arg)
+{
+	return (kvm_vm_backend(ctx, task, program, url, arg, KVM_PRIO_DEFAULT));
+}
+
 VCL_BACKEND vmod_vm_debug_backend(VRT_CTX, VCL_PRIV task,
 	VCL_STRING program, VCL_STRING key, VCL_STRING url, VCL_STRING arg)
 {
@@ -18,6 +18,16 @@ struct vmod_kvm_inputs
 	const char *content_type;
 };
 
+/* Reservation priority classes. When requests have to wait for a
+   request VM, free VMs are shared between the waiting classes by
+   weight, so that background work cannot starve interactive work. */
+enum kvm_priority
+{
+	KVM_PRIO_INTERACTIVE = 0,
+	KVM_PRIO_DEFAULT     = 1,
+	KVM_PRIO_BACKGROUND  = 2,
+};
+
 struct kvm_chain_item
 {
 	struct vmod_kvm_tenant *tenant;
@@ -25,6 +35,7 @@ struct kvm_chain_item
 	struct vmod_kvm_inputs inputs;
 	uint16_t break_status;
 	int16_t  soft_reset;
+	uint8_t  priority; /* enum kvm_priority */
 };
 struct kvm_program_chain
 {
@@ -370,6 +370,12 @@ static inline long set_cacheable(bool cached, float ttl, float grace, float keep
  * more functions are allowed, then only those functions can be called in
  * storage, effectively making it an allow list.
  *
+ * Functions that only read storage can be allowed with the
+ * STORAGE_ALLOW_READONLY(function) macro instead. When the program is
+ * configured with storage_readers, these are called concurrently on forked
+ * views of storage, instead of one at a time. Anything a read-only function
+ * writes is discarded after the call.
+ *
  * When calling into the storage program the data you provide will be copied into
  * the storage program, and the response you give back will be copied back into
  * the request-handling program. This is extra overhead, but very safe. It is
@@ -457,6 +463,20 @@ typedef void (*storage_func) (size_t n, struct virtbuffer[], size_t res);
 extern int
 sys_is_storage();
 
+/* Reserve a buffer in the storage mailbox, see storage_mailbox. The
+   buffer is in storage memory, which requests can access directly, and
+   storage calls pass it to storage by reference instead of copying it.
+   When the destination of a storage call is a mailbox buffer, it is
+   passed to the storage function as a fourth argument, and a result
+   written there and returned with storage_return(dst, len) is not
+   copied either. Buffers belong to the request until it ends.
+   Returns NULL when the mailbox is full or not enabled. */
+extern void *
+storage_mailbox(size_t len);
+
+/* A storage function that takes the mailbox destination, if any. */
+typedef void (*storage_mailbox_func) (size_t n, struct virtbuffer[], size_t res, void *dst);
+
 /* Transfer an array of buffers to storage, transfer output into @dst. */
 extern long
 storage_callv(storage_func, size_t n, const struct virtbuffer[], void* dst, size_t);
@@ -470,20 +490,45 @@ storage_call(storage_func func, const void *src, size_t len, void *res, size_t r
 	return storage_callv(func, 1, buf, res, reslen);
 }
 
+/* Like storage_callv, but the call goes to the storage shard selected by
+   @key, a hash of whatever the call operates on. Calls with the same key
+   always go to the same shard. Without storage_shards there is only one
+   shard, and this is the same as storage_callv. */
+extern long
+storage_callv_key(uint64_t key, storage_func, size_t n, const struct virtbuffer[], void* dst, size_t);
+
+/* Transfer an array to the storage shard selected by @key. */
+static inline long
+storage_call_key(uint64_t key, storage_func func, const void *src, size_t len, void *res, size_t reslen) {
+	const struct virtbuffer buf[1] = {
+		{ .data = src, .len = len }
+	};
+	return storage_callv_key(key, func, 1, buf, res, reslen);
+}
+
 /* Create a task in storage that is scheduled to run next.
    If start or period is set, the task will be scheduled to run after
    start milliseconds, and then run every period milliseconds. The
    system call returns the timer id.
-   If it is a periodic task, it will return a task id. */
+   If it is a periodic task, it will return a task id.
+   A task function may instead return a long, which storage_task_result() reports. */
 typedef void (*storage_task_func) (void *data, size_t len);
 
 extern long
 sys_storage_task(storage_task_func, const void* data, size_t len, uint64_t start, uint64_t period);
 
-/* Schedule a storage task to happen next. It will be queued up for storage access. */
+/* Schedule a storage task to happen next. It will be queued up for storage access.
+   Returns 0, or -1 when the storage task queue is full, see storage_task_queue. */
 static inline long
 storage_task(storage_task_func task, const void *data, size_t len) { return sys_storage_task(task, data, len, 0, 0); }
 
+/* Like storage_task(), but returns a task id for storage_task_result(), or -1 when
+   the storage task queue is full. When the queue coalesces, the id of a queued task
+   calling the same function may be returned instead. That task will now run with
+   this data, and the data it was queued with is discarded. */
+extern long
+storage_task_handle(storage_task_func task, const void *data, size_t len);
+
 /* Schedule a storage task to happen at some point. It will be queued up for storage access periodically. */
 static inline long
 schedule_storage_task(storage_task_func task, const void *data, size_t len, float start, float period) {
@@ -494,6 +539,13 @@ schedule_storage_task(storage_task_func task, const void *data, size_t len, floa
 extern long
 stop_storage_task(long task);
 
+/* Poll a task queued by storage_task_handle(). Returns 1 when the task has finished,
+   writing the value the task function returned to result (when not NULL),
+   0 while it is queued or running, -1 when it failed, and -2 when the task
+   is unknown or too old to have its result kept. */
+extern long
+storage_task_result(long task, long *result);
+
 /* Used to return data from a storage function, and then return and complete the function.
    NOTE: This function *always* returns back allowing cleanup, such as destructors. */
 extern void
@@ -512,6 +564,32 @@ storage_noreturn(const void* data, size_t len);
 extern long sys_storage_allow(void(*)());
 #define STORAGE_ALLOW(x) sys_storage_allow((void(*)())x)
 
+/* Allow a certain function to be called from a request VM, and promise
+   that it does not modify storage. Read-only functions can be called
+   concurrently, see storage_readers. */
+extern long sys_storage_allow_readonly(void(*)());
+#define STORAGE_ALLOW_READONLY(x) sys_storage_allow_readonly((void(*)())x)
+
+/* Storage calls that are waiting for storage can be run together in
+   batches, see storage_batch. Storage enables batching by registering
+   the batch entry point, which calls each storage function in turn. */
+struct storage_batch_call {
+	storage_func func;
+	size_t n;
+	struct virtbuffer *buffers;
+	size_t res;
+	void *dst;
+};
+static inline void
+storage_batch_entry(size_t count, struct storage_batch_call calls[], volatile size_t *current) {
+	for (size_t i = 0; i < count; i++) {
+		*current = i;
+		((storage_mailbox_func)calls[i].func)(calls[i].n, calls[i].buffers, calls[i].res, calls[i].dst);
+	}
+}
+extern long sys_storage_allow_batch(void (*)(size_t, struct storage_batch_call[], volatile size_t *));
+#define STORAGE_ALLOW_BATCH() sys_storage_allow_batch(storage_batch_entry)
+
 /* Start multi-processing using @n vCPUs on given function,
    forwarding up to 4 integral/pointer arguments.
    Multi-processing starts and ends asynchronously.
@@ -918,6 +996,48 @@ asm(".global stop_storage_task\n"
 	"	out %eax, $0\n"
 	"   ret\n");
 
+asm(".global storage_task_handle\n"
+	".type storage_task_handle, @function\n"
+	"storage_task_handle:\n"
+	"	mov $0x10714, %eax\n"
+	"	out %eax, $0\n"
+	"   ret\n");
+
+asm(".global storage_task_result\n"
+	".type storage_task_result, @function\n"
+	"storage_task_result:\n"
+	"	mov $0x1070F, %eax\n"
+	"	out %eax, $0\n"
+	"   ret\n");
+
+asm(".global sys_storage_allow_readonly\n"
+	".type sys_storage_allow_readonly, @function\n"
+	"sys_storage_allow_readonly:\n"
+	"	mov $0x1070B, %eax\n"
+	"	out %eax, $0\n"
+	"   ret\n");
+
+asm(".global storage_callv_key\n"
+	".type storage_callv_key, @function\n"
+	"storage_callv_key:\n"
+	"	mov $0x1070C, %eax\n"
+	"	out %eax, $0\n"
+	"   ret\n");
+
+asm(".global sys_storage_allow_batch\n"
+	".type sys_storage_allow_batch, @function\n"
+	"sys_storage_allow_batch:\n"
+	"	mov $0x1070D, %eax\n"
+	"	out %eax, $0\n"
+	"   ret\n");
+
+asm(".global storage_mailbox\n"
+	".type storage_mailbox, @function\n"
+	"storage_mailbox:\n"
+	"	mov $0x1070E, %eax\n"
+	"	out %eax, $0\n"
+	"   ret\n");
+
 asm(".global storage_return\n"
 	".type storage_return, @function\n"
 	"storage_return:\n"
@@ -27,6 +27,7 @@ extern void kvm_varnishstat_program_cpu_time(vtim_real);
 extern void kvm_backend_call(VRT_CTX, KVM_SLOT,
 	const struct kvm_chain_item *, struct backend_post *, struct backend_result *);
 extern struct kvm_program_chain* kvm_chain_get_queue();
+extern void kvm_chain_set_priority(struct kvm_program_chain *, int priority);
 extern struct kvm_chain_item *kvm_init_chain(VRT_CTX, struct vmod_kvm_tenant *tenant,
 	const char *url, const char *arg);
 extern int kvm_handle_post_to_another(VRT_CTX, struct backend_post *post,
@@ -97,7 +98,8 @@ to_string(VRT_CTX, struct kvm_program_chain *chain, content_func_f content_callb
 		waiting for a free VM, and then getting exclusive access until
 		the end of the request. */
 		struct vmod_kvm_slot *slot =
-			kvm_temporarily_reserve_machine(ctx, invocation->tenant, false, invocation->soft_reset);
+			kvm_temporarily_reserve_machine(ctx, invocation->tenant, false, invocation->soft_reset,
+				invocation->priority);
 		if (slot == NULL) {
 			/* Global program cpu-time statistic. */
 			kvm_varnishstat_program_cpu_time(VTIM_real() - t0);
@@ -212,7 +214,7 @@ static void to_string_callback(const struct backend_result *result, struct kvm_h
 
 VCL_STRING kvm_vm_to_string(VRT_CTX, VCL_PRIV task,
 	VCL_STRING program, VCL_STRING url, VCL_STRING arg, VCL_STRING on_error,
-	VCL_INT error_treshold, VCL_INT soft_reset)
+	VCL_INT error_treshold, VCL_INT soft_reset, int priority)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	AN(task);
@@ -237,6 +239,7 @@ VCL_STRING kvm_vm_to_string(VRT_CTX, VCL_PRIV task,
 	invocation->inputs.content_type = "";
 	invocation->break_status = error_treshold;
 	invocation->soft_reset = soft_reset;
+	kvm_chain_set_priority(kvm_chain_get_queue(), priority);
 
 	/* XXX: Immediately reset it. It's a thread_local! */
 	struct kvm_program_chain chain = *kvm_chain_get_queue();
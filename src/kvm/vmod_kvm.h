@@ -50,8 +50,9 @@ extern int     kvm_tenant_configure(VRT_CTX, TEN_PTR, const char *json);
 extern int     kvm_tenant_arguments(VRT_CTX, TEN_PTR, size_t n, const char **strings);
 extern int     kvm_tenant_async_start(VRT_CTX, TEN_PTR, int debug);
 extern int     kvm_tenant_unload(VRT_CTX, TEN_PTR);
-extern KVM_SLOT kvm_reserve_machine(VRT_CTX, TEN_PTR, int debug);
-extern KVM_SLOT kvm_temporarily_reserve_machine(VRT_CTX, TEN_PTR, int debug, int soft_reset);
+extern KVM_SLOT kvm_reserve_machine(VRT_CTX, TEN_PTR, int debug, int priority);
+extern KVM_SLOT kvm_temporarily_reserve_machine(VRT_CTX, TEN_PTR, int debug, int soft_reset, int priority);
+extern int      kvm_reservation_shed(unsigned *retry_after);
 extern void     kvm_free_reserved_machine(VRT_CTX, void* slot);
 #ifdef VARNISH_PLUS
 extern vmod_priv_free_f *kvm_get_free_function();
@@ -215,10 +215,11 @@ VCL_BOOL vmod_start(VRT_CTX, VCL_PRIV task, VCL_STRING program, VCL_BOOL async,
 	}
 }
 
-extern struct director *vmod_vm_backend(VRT_CTX, VCL_PRIV task,
-	VCL_STRING tenant, VCL_STRING url, VCL_STRING arg);
+extern struct director *kvm_vm_backend(VRT_CTX, VCL_PRIV task,
+	VCL_STRING tenant, VCL_STRING url, VCL_STRING arg, int priority);
 extern const char *kvm_vm_to_string(VRT_CTX, VCL_PRIV task,
-	VCL_STRING tenant, VCL_STRING url, VCL_STRING arg, VCL_STRING on_error, VCL_INT, VCL_INT);
+	VCL_STRING tenant, VCL_STRING url, VCL_STRING arg, VCL_STRING on_error, VCL_INT, VCL_INT, int priority);
+extern int kvm_parse_priority(const char *priority);
 extern int kvm_vm_synth(VRT_CTX, VCL_PRIV task, VCL_INT status,
 	VCL_STRING tenant, VCL_STRING url, VCL_STRING arg, VCL_INT soft_reset);
 extern VCL_BOOL kvm_vm_begin_epoll(VRT_CTX, VCL_PRIV, VCL_STRING program,
@@ -226,7 +227,7 @@ extern VCL_BOOL kvm_vm_begin_epoll(VRT_CTX, VCL_PRIV, VCL_STRING program,
 
 /* Create a response through a KVM backend. */
 VCL_BACKEND vmod_program(VRT_CTX, VCL_PRIV task,
-	VCL_STRING program, VCL_STRING arg, VCL_STRING json_config)
+	VCL_STRING program, VCL_STRING arg, VCL_STRING json_config, VCL_STRING priority)
 {
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	if (ctx->method != VCL_MET_BACKEND_FETCH) {
@@ -234,16 +235,27 @@ VCL_BACKEND vmod_program(VRT_CTX, VCL_PRIV task,
 			"compute: program() should only be called from vcl_backend_fetch");
 		return (NULL);
 	}
+	const int prio = kvm_parse_priority(priority);
+	if (prio < 0) {
+		VRT_fail(ctx, "compute: Invalid priority '%s'", priority);
+		return (NULL);
+	}
 
-	return (vmod_vm_backend(ctx, task, program, arg, json_config));
+	return (kvm_vm_backend(ctx, task, program, arg, json_config, prio));
 }
 
 /* Create a string response from given program and arguments. */
 VCL_STRING vmod_to_string(VRT_CTX, VCL_PRIV task,
 	VCL_STRING program, VCL_STRING url, VCL_STRING argument,
-	VCL_STRING on_error, VCL_INT error_treshold, VCL_INT soft_reset)
+	VCL_STRING on_error, VCL_INT error_treshold, VCL_INT soft_reset,
+	VCL_STRING priority)
 {
-	return (kvm_vm_to_string(ctx, task, program, url, argument, on_error, error_treshold, soft_reset));
+	const int prio = kvm_parse_priority(priority);
+	if (prio < 0) {
+		VRT_fail(ctx, "compute: Invalid priority '%s'", priority);
+		return (on_error);
+	}
+	return (kvm_vm_to_string(ctx, task, program, url, argument, on_error, error_treshold, soft_reset, prio));
 }
 
 /* Create a synthetic response from given program and arguments. */
@@ -101,3 +101,59 @@ void kvm_varnishstat_program_status(uint16_t status)
 	else if (status >= 400)
 		__sync_fetch_and_add(&vsc_vmod_kvm->program_status_4xx, 1);
 }
+
+void kvm_varnishstat_requests_shed()
+{
+	__sync_fetch_and_add(&vsc_vmod_kvm->requests_shed, 1);
+}
+
+void kvm_varnishstat_budget(uint64_t memory, uint64_t vms)
+{
+	vsc_vmod_kvm->budget_memory = memory;
+	vsc_vmod_kvm->budget_vms = vms;
+}
+
+void kvm_varnishstat_budget_eviction()
+{
+	__sync_fetch_and_add(&vsc_vmod_kvm->budget_evictions, 1);
+}
+
+void kvm_varnishstat_shared_object(int hit, uint64_t bytes)
+{
+	if (hit)
+		__sync_fetch_and_add(&vsc_vmod_kvm->shared_object_hits, 1);
+	else
+		__sync_fetch_and_add(&vsc_vmod_kvm->shared_object_misses, 1);
+	vsc_vmod_kvm->shared_object_bytes = bytes;
+}
+
+void kvm_varnishstat_snapshot_cache(int hit, uint64_t bytes)
+{
+	if (hit > 0)
+		__sync_fetch_and_add(&vsc_vmod_kvm->snapshot_cache_hits, 1);
+	else if (hit == 0)
+		__sync_fetch_and_add(&vsc_vmod_kvm->snapshot_cache_misses, 1);
+	vsc_vmod_kvm->snapshot_cache_bytes = bytes;
+}
+
+void kvm_varnishstat_queue_depth(int64_t delta)
+{
+	__sync_fetch_and_add(&vsc_vmod_kvm->queue_depth, delta);
+}
+
+void kvm_varnishstat_vms_in_use(int64_t delta)
+{
+	__sync_fetch_and_add(&vsc_vmod_kvm->vms_in_use, delta);
+}
+
+void kvm_varnishstat_latency(const uint64_t reservation_wait[4], const uint64_t request[4])
+{
+	vsc_vmod_kvm->reservation_wait_p50  = reservation_wait[0];
+	vsc_vmod_kvm->reservation_wait_p90  = reservation_wait[1];
+	vsc_vmod_kvm->reservation_wait_p99  = reservation_wait[2];
+	vsc_vmod_kvm->reservation_wait_p999 = reservation_wait[3];
+	vsc_vmod_kvm->request_time_p50  = request[0];
+	vsc_vmod_kvm->request_time_p90  = request[1];
+	vsc_vmod_kvm->request_time_p99  = request[2];
+	vsc_vmod_kvm->request_time_p999 = request[3];
+}